@@ -0,0 +1,357 @@
+// (C) 2013 Kim, Taegyoon
+// Paren benchmark suite: runs each benchmark in a fresh interpreter and writes the results as JSON,
+// one benchmark per line, so that the files of two builds can be diffed or compared with -c
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include "../libparen.h"
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+using namespace libparen;
+
+static const double MIN_TIME = 0.5; // seconds each benchmark is repeated for
+static const int MAX_REPS = 100000;
+
+struct benchmark {
+    const char *name;
+    const char *kind; // micro or macro
+    const char *unit; // what ops counts
+    size_t ops; // in one run
+    const char *setup; // run once before timing
+    const char *code; // timed; a file name if it ends in .paren
+    bool jit; // if hot loops are compiled to machine code
+    void (*run)(paren &p, const string &source); // timed instead of code, on the source of all benchmarks
+};
+
+static const char *FACTORIAL = "(set factorial (fn (x) (if (<= x 1) x (* x (factorial (dec x))))))";
+static const char *FIB = "(set fib (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))";
+static const char *EVEN = "(set even? (fn (x) (== 0 (% x 2))))";
+
+static const char *EULER1 =
+    "(set s 0)\n"
+    "(for i 1 999 1\n"
+    "    (when (|| (== 0 (% i 3)) (== 0 (% i 5)))\n"
+    "        (set s (+ s i))))\n"
+    "(prn s)\n";
+static const char *EULER1_FILTER = "(prn (apply + (filter (fn (x) (|| (== 0 (% x 3)) (== 0 (% x 5)))) (range 1 999 1))))\n";
+static const char *EULER2 =
+    "(set a 1)\n"
+    "(set b 1)\n"
+    "(set sum 0)\n"
+    "(while (<= a 4000000)\n"
+    "  (set c (+ a b))\n"
+    "  (set a b)\n"
+    "  (set b c)\n"
+    "  (when (== 0 (% a 2))\n"
+    "    (set sum (+ sum a))))\n"
+    "(prn sum)\n";
+static const char *EULER4 =
+    "(set maxP 0)\n"
+    "(for i 100 999 1\n"
+    "  (for j 100 999 1\n"
+    "    (set p (* i j))\n"
+    "    (set ps (string p))\n"
+    "    (set len (strlen ps))\n"
+    "    (set to (/ len 2))\n"
+    "    (set pal true)\n"
+    "    (set k 0)\n"
+    "    (set k2 (dec len))\n"
+    "    (while\n"
+    "      (&& (< k to) pal)\n"
+    "      (when (!= (char-at ps k) (char-at ps k2))\n"
+    "        (set pal false))\n"
+    "      (++ k)\n"
+    "      (-- k2))\n"
+    "    (when pal\n"
+    "      (when (> p maxP)\n"
+    "        (set maxP p)))))\n"
+    "(prn maxP)\n";
+
+static void tokenize(paren &p, const string &source) {
+    p.tokenize(source);
+}
+
+static void parse(paren &p, const string &source) {
+    p.parse(source);
+}
+
+static const benchmark benchmarks[] = {
+    {"tokenize", "micro", "byte", 0, NULL, NULL, true, tokenize},
+    {"parse", "micro", "byte", 0, NULL, NULL, true, parse},
+    {"lookup-depth", "micro", "lookup", 500000, // four enclosing fns and a global
+        "(set n 0) (set f (fn (a) (fn (b) (fn (c) (fn (d) (fn () (+ a b c d n))))))) (set g ((((f 1) 2) 3) 4))",
+        "(for i 1 100000 1 (g))", true, NULL},
+    {"arith", "micro", "op", 600000, NULL,
+        "(set x 0) (for i 1 200000 1 (set x (% (+ (* x 31) i) 1000003)))", false, NULL},
+    {"arith-native", "micro", "op", 6000000, NULL,
+        "(set x 0) (for i 1 2000000 1 (set x (% (+ (* x 31) i) 1000003)))", true, NULL},
+    {"closure-call", "micro", "call", 100000, "(set add (fn (a b) (+ a b)))",
+        "(set s 0) (for i 1 100000 1 (set s (add s 1)))", true, NULL},
+    {"list-copy", "micro", "item", 200000, "(set l (to-list (range 0 9999 1)))",
+        "(for i 1 20 1 (apply list l))", true, NULL},
+    {"map-filter", "micro", "item", 400000, "(set l (to-list (range 0 9999 1))) (set even? (fn (x) (== 0 (% x 2))))",
+        "(for i 1 20 1 (filter even? (map inc l)))", true, NULL},
+    {"strcat", "micro", "call", 100000, NULL,
+        "(set s \"\") (for i 1 100000 1 (set s (strcat s \"abcdefgh\")))", true, NULL},
+    {"print", "micro", "line", 100000, NULL,
+        "(for i 1 100000 1 (prn i 2.5 \"abc\"))", true, NULL},
+    {"hash-map", "micro", "lookup", 100000, "(set m (hash-map)) (for i 0 9999 1 (put m i i))",
+        "(set t 0) (for i 0 99999 1 (set t (+ t (get m (% i 10000)))))", true, NULL},
+    {"pmap", "micro", "item", 2000, FIB, // on -j threads
+        "(pmap (fn (n) (fib (+ 10 (% n 6)))) (range 1 2000 1))", true, NULL},
+    {"preduce", "micro", "item", 1000000, "(set l (to-list (range 1 1000000 1)))",
+        "(preduce + 0 l)", true, NULL},
+    {"euler1", "macro", "run", 1, NULL, EULER1, true, NULL},
+    {"euler1-filter", "macro", "run", 1, NULL, EULER1_FILTER, true, NULL},
+    {"euler2", "macro", "run", 1, NULL, EULER2, true, NULL},
+    {"euler4", "macro", "run", 1, NULL, EULER4, true, NULL},
+    {"factorial", "macro", "call", 120000, FACTORIAL, "(for i 1 10000 1 (factorial 12))", true, NULL},
+    {"fib", "macro", "call", 242785, FIB, "(fib 25)", true, NULL},
+    {"strcat-file", "macro", "run", 1, NULL, "bench/strcat.paren", true, NULL},
+    {"map-file", "macro", "run", 1, NULL, "bench/map.paren", true, NULL},
+    {"alist-file", "macro", "run", 1, NULL, "bench/alist.paren", true, NULL},
+};
+static const int BENCHMARKS = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+class null_buffer: public streambuf { // output of the benchmarks, discarded
+protected:
+    int overflow(int c) {return c;}
+    streamsize xsputn(const char *, streamsize n) {return n;}
+};
+
+static bool read_file(const string &path, string &data) {
+    ifstream file(path.c_str(), ios::binary);
+    if (!file) return false;
+    data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return true;
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// the code of every benchmark, about 1 MB of it, for the tokenizer and parser
+static string all_source() {
+    string one = string(FACTORIAL) + FIB + EVEN + EULER1 + EULER1_FILTER + EULER2 + EULER4;
+    for (int i = 0; i < BENCHMARKS; i++) {
+        if (benchmarks[i].setup != NULL) one += benchmarks[i].setup;
+        if (benchmarks[i].code != NULL && !ends_with(benchmarks[i].code, ".paren")) one += benchmarks[i].code;
+        one += '\n';
+    }
+    string all;
+    while (all.size() < (1 << 20)) all += one;
+    return all;
+}
+
+static long peak_rss_kb() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+// the JSON line of the results of b, or "" after an error
+static string run(const benchmark &b, bool vm, int threads) {
+    null_buffer discard;
+    ostream null_out(&discard);
+    paren p;
+    p.out = &null_out;
+    p.flush_policy = paren::FLUSH_FULL;
+    p.vm = vm;
+    if (threads > 0) p.threads = threads;
+    p.jit = b.jit;
+    string source;
+    size_t ops = b.ops;
+    if (b.run != NULL) {
+        source = all_source();
+        ops = source.size();
+    }
+    else if (ends_with(b.code, ".paren")) {
+        if (!read_file(b.code, source)) {
+            fprintf(stderr, "Cannot open file: %s\n", b.code);
+            return "";
+        }
+    }
+    else {
+        source = b.code;
+    }
+    if (b.setup != NULL) p.eval_string(b.setup);
+    vector<node> code; // parsed once: later runs find it quickened
+    gc_root root(p.gc, code);
+    if (b.run == NULL) code = p.parse(source);
+
+    heap::statistics before = p.gc.stats;
+    double best = 1e300, total = 0;
+    int reps = 0;
+    while (reps == 0 || (total < MIN_TIME && reps < MAX_REPS)) {
+        auto start = chrono::steady_clock::now();
+        if (b.run != NULL) {
+            b.run(p, source);
+        }
+        else {
+            p.eval_all(code);
+        }
+        double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, t);
+        total += t;
+        reps++;
+    }
+    const heap::statistics &after = p.gc.stats;
+
+    char line[512];
+    snprintf(line, sizeof(line), "{\"name\": \"%s\", \"kind\": \"%s\", \"unit\": \"%s\", \"ops\": %zu, \"reps\": %d, "
+        "\"seconds\": %.9g, \"ops_per_sec\": %.1f, \"allocated_objects\": %zu, \"allocated_bytes\": %zu, "
+        "\"collections\": %zu, \"peak_rss_kb\": %ld}",
+        b.name, b.kind, b.unit, ops, reps, best, ops / best, (after.allocated_objects - before.allocated_objects) / reps,
+        (after.allocated_bytes - before.allocated_bytes) / reps, after.collections - before.collections, peak_rss_kb());
+    return line;
+}
+
+// runs b in a child process, so that its peak memory is its own
+static string run_apart(const benchmark &b, bool vm, int threads) {
+#ifndef _WIN32
+    int fds[2];
+    if (pipe(fds) != 0) return run(b, vm, threads);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return run(b, vm, threads);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        string line = run(b, vm, threads);
+        bool ok = write(fds[1], line.data(), line.size()) == (ssize_t) line.size();
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    string line;
+    char buf[512];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) line.append(buf, n);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Benchmark failed: %s\n", b.name);
+        return "";
+    }
+    return line;
+#else
+    return run(b, vm, threads);
+#endif
+}
+
+// the value of "key": in a result line, or -1
+static double field(const string &line, const char *key) {
+    size_t i = line.find(string("\"") + key + "\": ");
+    if (i == string::npos) return -1;
+    return atof(line.c_str() + i + strlen(key) + 4);
+}
+
+static string name_of(const string &line) {
+    size_t i = line.find("\"name\": \"");
+    if (i == string::npos) return "";
+    i += 9;
+    return line.substr(i, line.find('"', i) - i);
+}
+
+// prints the change of ops/sec of each benchmark from the results in file a to those in file b
+static int compare(const char *a, const char *b) {
+    string data[2];
+    if (!read_file(a, data[0]) || !read_file(b, data[1])) {
+        fprintf(stderr, "Cannot open file: %s\n", read_file(a, data[0]) ? b : a);
+        return 1;
+    }
+    map<string, double> old;
+    istringstream in_a(data[0]), in_b(data[1]);
+    string line;
+    while (getline(in_a, line)) {
+        if (!name_of(line).empty()) old[name_of(line)] = field(line, "ops_per_sec");
+    }
+    printf("%-16s %14s %14s %8s\n", "name", "old ops/s", "new ops/s", "change");
+    while (getline(in_b, line)) {
+        string name = name_of(line);
+        if (name.empty()) continue;
+        double now = field(line, "ops_per_sec");
+        if (old.count(name) == 0) {
+            printf("%-16s %14s %14.0f\n", name.c_str(), "-", now);
+            continue;
+        }
+        printf("%-16s %14.0f %14.0f %+7.1f%%\n", name.c_str(), old[name], now, (now / old[name] - 1) * 100);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bool vm = false;
+    int threads = 0; // of the interpreter: one per core
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-h") == 0) {
+            puts("Usage: paren-bench [OPTIONS...] [NAMES...]");
+            puts("       paren-bench -c OLD.json NEW.json");
+            puts("");
+            puts("Runs the benchmarks NAMES (default: all) and writes the results to stdout as JSON.");
+            puts("");
+            puts("OPTIONS:");
+            puts("    -h    print this screen.");
+            puts("    -l    list the benchmarks.");
+            puts("    -b    run on the bytecode virtual machine.");
+            puts("    -j N  run pmap, pfilter and preduce on N threads. (default: one per core)");
+            puts("    -c    compare the ops/sec of two result files.");
+            return 0;
+        } else if (strcmp(argv[first], "-l") == 0) {
+            for (int i = 0; i < BENCHMARKS; i++) printf("%-16s %s\n", benchmarks[i].name, benchmarks[i].kind);
+            return 0;
+        } else if (strcmp(argv[first], "-b") == 0) {
+            vm = true;
+        } else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+            threads = atoi(argv[++first]);
+            if (threads < 1) {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[first]);
+                return 1;
+            }
+        } else if (strcmp(argv[first], "-c") == 0 && first + 2 < argc) {
+            return compare(argv[first + 1], argv[first + 2]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[first]);
+            return 1;
+        }
+    }
+
+    for (int j = first; j < argc; j++) {
+        bool known = false;
+        for (int i = 0; i < BENCHMARKS; i++) known = known || strcmp(argv[j], benchmarks[i].name) == 0;
+        if (!known) {
+            fprintf(stderr, "Unknown benchmark: %s\n", argv[j]);
+            return 1;
+        }
+    }
+
+    printf("{\"version\": \"%s\", \"vm\": %s, \"threads\": %d, \"benchmarks\": [\n", PAREN_VERSION, vm ? "true" : "false",
+        threads > 0 ? threads : max((int) thread::hardware_concurrency(), 1));
+    bool any = false;
+    for (int i = 0; i < BENCHMARKS; i++) {
+        bool chosen = first >= argc;
+        for (int j = first; j < argc; j++) chosen = chosen || strcmp(argv[j], benchmarks[i].name) == 0;
+        if (!chosen) continue;
+        fprintf(stderr, "%s\n", benchmarks[i].name);
+        string line = run_apart(benchmarks[i], vm, threads);
+        if (line.empty()) continue;
+        printf("%s%s", any ? ",\n" : "", line.c_str());
+        any = true;
+    }
+    printf("\n]}\n");
+}
@@ -2,21 +2,80 @@
 // Paren language core
 
 #include "libparen.h"
+#include <chrono>
+#include <csetjmp>
+#include <stdexcept>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstddef>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PAREN_AVX2 __attribute__((target("avx2"))) // vector kernels are also compiled for AVX2
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h> // map control bytes are matched a group at a time
+#endif
+#if defined(__GNUC__)
+#define PAREN_COLD __attribute__((noinline, cold)) // kept out of the code of eval
+#else
+#define PAREN_COLD
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#define PAREN_NATIVE // hot loops are compiled to machine code
+#include <sys/mman.h>
+#endif
 
 namespace libparen {
     using namespace std;
 
-    paren::paren() {
+    paren::paren(): symbols(symbol_table::global()), vm(false), opt(false), threads(max((int) thread::hardware_concurrency(), 1)), jit(true),
+        rng((unsigned int) time(0) ^ (unsigned int) (uintptr_t) this), out(&cout), flush_policy(FLUSH_LINE), err(&cerr), in(&cin),
+        stats(), call_cache(1024), profiling(NULL) {
+        heap::current() = &gc;
+        gc.envs.push_back(&global_env);
         init();
     }
 
+    paren::~paren() {
+        pool.reset();
+        prof.reset();
+        flush();
+        if (heap::current() == &gc) heap::current() = gc.outer();
+    }
+
     node::node(): type(T_NIL) {}
     node::node(int a): type(T_INT), v_int(a) {}
     node::node(double a): type(T_DOUBLE), v_double(a) {}
     node::node(bool a): type(T_BOOL), v_bool(a) {}
-    node::node(const string a): type(T_STRING), v_string(a) {}
-    node::node(const vector<node> &a): type(T_LIST), v_list(a) {}
-    node nil;
+    node::node(const char *a): type(T_STRING), v_obj(new string_object(a)) {heap::current()->account(v_obj->extra());}
+    node::node(const string &a): type(T_STRING), v_obj(new string_object(a)) {heap::current()->account(v_obj->extra());}
+    node::node(const vector<node> &a): type(T_LIST), v_obj(list_object::make(a.data(), a.size())) {}
+    node::node(int type, object *o): v_obj(o) {this->type = (decltype(this->type)) type;}
+
+    // the operations that have quickened forms, in the order of the forms
+    static const int quickened[] = {node::PLUS, node::MINUS, node::MUL, node::DIV, node::EQEQ, node::NOTEQ,
+        node::LT, node::GT, node::LTE, node::GTE};
+    static const int QUICKENED = sizeof(quickened) / sizeof(quickened[0]);
+
+    // the builtin that b is a quickened form of, or b
+    inline int generic(int b) {
+        if (b < node::PLUS_II) return b;
+        if (b == node::NTH_LIST) return node::NTH;
+        if (b >= node::NATIVE) return (b - node::NATIVE) % 2 ? node::WHILE : node::FOR;
+        return quickened[(b - node::PLUS_II) % QUICKENED];
+    }
 
     inline int node::to_int() {
         switch (type) {
@@ -26,8 +85,9 @@ namespace libparen {
             return (int) v_double;
         case T_BOOL:
             return (int) v_bool;
-        case T_STRING:
-            return atoi(v_string.c_str());
+        case T_STRING: {
+            string_object *s = (string_object *) v_obj;
+            return atoi(s->buf == NULL ? s->v.c_str() : string(s->view()).c_str());}
         default:
             return 0;
         }
@@ -41,41 +101,91 @@ namespace libparen {
             return v_double;
         case T_BOOL:
             return v_bool;
-        case T_STRING:
-            return atof(v_string.c_str());
+        case T_STRING: {
+            string_object *s = (string_object *) v_obj;
+            return atof(s->buf == NULL ? s->v.c_str() : string(s->view()).c_str());}
         default:
             return 0.0;
         }
     }
-    inline string node::to_str() {
-        stringstream ss;
-        ss.precision(20);
-        switch (type) {
-        case T_NIL: break;
-        case T_INT:
-            ss << v_int; break;
-        case T_BUILTIN:
-            ss << "builtin." << v_int; break;
-        case T_DOUBLE:
-            ss << v_double; break;
-        case T_BOOL:
-            return (v_bool ? "true" : "false");
-        case T_STRING:
-        case T_SYMBOL:
-            return v_string;
-        case T_FN:
-        case T_LIST:
+    // appends the number x to s, in the shortest form that reads back as x
+    template <class T> inline void append_number(string &s, T x) {
+        char buf[32];
+        s.append(buf, to_chars(buf, buf + sizeof(buf), x).ptr - buf);
+    }
+
+    // appends the text of n to s. lists are written item by item, without a string of each
+    static void format(const node &n, string &s) {
+        switch (n.type) {
+        case node::T_NIL: break;
+        case node::T_INT:
+            append_number(s, n.v_int); break;
+        case node::T_BUILTIN:
+            s += "builtin.";
+            append_number(s, generic(n.v_int)); break;
+        case node::T_DOUBLE:
+            append_number(s, n.v_double); break;
+        case node::T_BOOL:
+            s += n.v_bool ? "true" : "false"; break;
+        case node::T_STRING:
+            s += ((string_object *) n.v_obj)->view(); break;
+        case node::T_SYMBOL:
+        case node::T_LOCAL:
+            s += n.v_string(); break;
+        case node::T_FN:
+        case node::T_LIST:
+        case node::T_SEQ:
+            {
+                const list_object &l = n.v_list();
+                s += '(';
+                for (size_t i = 0; i < l.size(); i++) {
+                    if (i > 0) s += ' ';
+                    format(l[i], s);
+                }
+                s += ')';
+                break;
+            }
+        case node::T_VEC:
+            {
+                vec_object *v = (vec_object *) n.v_obj;
+                s += '(';
+                for (size_t i = 0; i < v->size(); i++) {
+                    if (i > 0) s += ' ';
+                    if (v->ints) append_number(s, v->i64[i]); else append_number(s, v->f64[i]);
+                }
+                s += ')';
+                break;
+            }
+        case node::T_MAP:
             {
-                ss << '(';
-                for (vector<node>::iterator iter = v_list.begin(); iter != v_list.end(); iter++) {
-                    if (iter != v_list.begin()) ss << ' ';
-                    ss << iter->to_str();
+                map_object *m = (map_object *) n.v_obj;
+                static thread_local vector<map_object *> open; // maps being formatted, that a map may hold
+                if (find(open.begin(), open.end(), m) != open.end()) {
+                    s += "{...}";
+                    break;
+                }
+                open.push_back(m);
+                s += '{';
+                bool first = true;
+                for (size_t i = 0; i < m->slots.size(); i++) {
+                    if (m->ctrl[i] < 0) continue;
+                    if (!first) s += ' ';
+                    first = false;
+                    format(m->slots[i].key, s);
+                    s += ' ';
+                    format(m->slots[i].value, s);
                 }
-                ss << ')';
+                s += '}';
+                open.pop_back();
                 break;
             }
         }
-        return ss.str();
+    }
+
+    inline string node::to_str() {
+        string s;
+        format(*this, s);
+        return s;
     }
     inline string node::type_str() {
         switch (type) {
@@ -90,6 +200,7 @@ namespace libparen {
         case T_STRING:
             return "string";
         case T_SYMBOL:
+        case T_LOCAL:
             return "symbol";
         case T_LIST:
             return "list";
@@ -97,6 +208,12 @@ namespace libparen {
             return "builtin";
         case T_FN:
             return "fn";
+        case T_SEQ:
+            return "seq";
+        case T_VEC:
+            return ((vec_object *) v_obj)->ints ? "i64vec" : "f64vec";
+        case T_MAP:
+            return "map";
         default:
             return "invalid type";
         }
@@ -106,734 +223,4380 @@ namespace libparen {
     }
 
     inline double paren::rand_double() {
-        return (double) rand() / ((double) RAND_MAX + 1.0);
+        unique_lock<mutex> l(lock, defer_lock);
+        if (gc.shared) l.lock();
+        return (double) rng() / ((double) rng.max() + 1.0);
     }
 
-    class tokenizer {
-    private:
-        vector<string> ret;
-        string acc; // accumulator
-        string s;
-        void emit() { // add accumulated string to token list
-            if (acc.length() > 0) {ret.push_back(acc); acc = "";}
-        }
+    // reads source text in one pass, building nodes straight from slices of it. only string literals
+    // with escapes, or split between inputs, are copied, into a reused buffer. the text may come in
+    // pieces, as lines to a REPL: the state of the scan carries over from one input to the next
+    class reader {
     public:
+        enum token {END, OPEN, CLOSE, STRING, ATOM};
         int unclosed; // number of unclosed parenthesis ( or quotation "
-        tokenizer(const string &s): s(s), unclosed(0) {}
+        reader(): unclosed(0), p(NULL), end(NULL), in_string(false), escape(false), done(false), root(items), stopped(false) {}
+        void input(string_view s) { // the next piece of text, which must outlive the calls to next or read
+            p = s.data();
+            end = s.data() + s.size();
+        }
+        void finish() {done = true;} // no more input: a string left open ends here
 
-        vector<string> tokenize() {
-            int last = s.length() - 1;
-            for (int pos=0; pos <= last; pos++) {
-                char c = s.at(pos);
+        token next(string_view &tok) { // tok is the text of a STRING or ATOM. END when the input is used up
+            if (in_string) {
+                if (!rest_of_string()) return END;
+                tok = buf;
+                return STRING;
+            }
+            while (p < end) {
+                char c = *p;
                 if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-                    emit();
+                    p++;
                 }
                 else if (c == ';') { // end-of-line comment
-                    emit();
-                    do pos++; while (pos <= last && s.at(pos) != '\n');
+                    while (p < end && *p != '\n') p++;
                 }
-                else if (c == '"') { // beginning of string
+                else if (c == '"') { // string
                     unclosed++;
-                    emit();
-                    acc += '"';
-                    pos++;
-                    while (pos <= last) {
-                        if (s.at(pos) == '"') {unclosed--; break;}
-                        if (s.at(pos) == '\\') { // escape
-                            char next = s.at(pos+1);
-                            if (next == 'r') next = '\r';
-                            else if (next == 'n') next = '\n';
-                            else if (next == 't') next = '\t';
-                            acc += next;
-                            pos += 2;
-                        }
-                        else {
-                            acc += s.at(pos);
-                            pos++;
-                        }
+                    const char *from = ++p;
+                    while (p < end && *p != '"' && *p != '\\') p++;
+                    if (p < end && *p == '"') { // no escapes: the slice itself
+                        tok = string_view(from, p - from);
+                        unclosed--;
+                        p++;
+                        return STRING;
                     }
-                    emit();
+                    buf.assign(from, p - from);
+                    in_string = true;
+                    if (!rest_of_string()) return END;
+                    tok = buf;
+                    return STRING;
                 }
                 else if (c == '(') {
                     unclosed++;
-                    emit();
-                    acc += c;
-                    emit();
+                    p++;
+                    return OPEN;
                 }
                 else if (c == ')') {
                     unclosed--;
-                    emit();
-                    acc += c;
-                    emit();
+                    p++;
+                    return CLOSE;
                 }
-                else {
-                    acc += c;
+                else { // number or symbol: up to a delimiter
+                    const char *from = p;
+                    while (p < end && !delimiter(*p)) p++;
+                    tok = string_view(from, p - from);
+                    return ATOM;
                 }
             }
-            emit();
-            return ret;
+            return END;
         }
-    };
 
-    vector<string> paren::tokenize(const string &s) {
-        return tokenizer(s).tokenize();
-    }
-
-    class parser {
-    private:
-        int pos;
-        vector<string> tokens;
-    public:
-        parser(const vector<string> &tokens): pos(0), tokens(tokens) {}
-        vector<node> parse() {
-            vector<node> ret;
-            int last = tokens.size() - 1;
-            for (;pos <= last; pos++) {
-                string tok = tokens.at(pos);
-                if (tok.at(0) == '"') { // double-quoted string
-                    ret.push_back(node(tok.substr(1)));
+        void read(symbol_table &symbols) { // the expressions of the input, up to an unmatched )
+            string_view tok;
+            for (token t = next(tok); t != END; t = next(tok)) {
+                if (stopped) continue;
+                if (t == OPEN) {
+                    open.push_back(items.size());
                 }
-                else if (tok == "(") { // list
-                    pos++;
-                    ret.push_back(node(parse()));
+                else if (t == CLOSE) {
+                    if (open.empty()) stopped = true;
+                    else close();
                 }
-                else if (tok == ")") { // end of list
-                    break;
+                else if (t == STRING) {
+                    items.push_back(node(string(tok)));
                 }
-                else if (isdigit(tok.at(0)) || (tok.at(0) == '-' && tok.length() >= 2 && isdigit(tok.at(1)))) { // number
-                    if (tok.find('.') != string::npos || tok.find('e') != string::npos) { // double
-                        ret.push_back(node(atof(tok.c_str())));
+                else if (isdigit((unsigned char) tok[0]) || (tok[0] == '-' && tok.size() >= 2 && isdigit((unsigned char) tok[1]))) { // number
+                    const char *first = tok.data(), *last = tok.data() + tok.size();
+                    if (tok.find('.') != string_view::npos || tok.find('e') != string_view::npos) { // double
+                        double d = 0;
+                        auto r = from_chars(first, last, d);
+                        if (r.ec != errc() || r.ptr != last) d = strtod(string(tok).c_str(), NULL); // out of range or malformed: as atof
+                        items.push_back(node(d));
                     } else {
-                        ret.push_back(node(atoi(tok.c_str())));
+                        long long i = 0;
+                        if (from_chars(first, last, i).ec == errc::result_out_of_range || i < INT_MIN || i > INT_MAX) {
+                            items.push_back(node(strtod(string(tok).c_str(), NULL))); // beyond int: the nearest double, as nth of an i64vec
+                        } else {
+                            items.push_back(node((int) i));
+                        }
                     }
-                } else { // symbol
+                }
+                else { // symbol
                     node n;
                     n.type = node::T_SYMBOL;
-                    n.v_string = tok;
-                    ret.push_back(n);
+                    n.v_int = symbols.intern(tok);
+                    items.push_back(n);
                 }
             }
+        }
+
+        vector<node> take() { // the expressions read, with the lists left open closed. starts over
+            while (!open.empty()) close();
+            vector<node> ret;
+            ret.swap(items);
+            unclosed = 0;
+            in_string = escape = done = stopped = false;
             return ret;
         }
+    private:
+        const char *p, *end;
+        bool in_string, escape; // within a string, after a backslash
+        bool done;
+        string buf; // unescaped string literal
+        vector<node> items; // of the top level, then of each open list
+        gc_root root;
+        vector<size_t> open; // index in items of the first item of each open list
+        bool stopped; // by an unmatched ): the rest is skipped
+
+        static bool delimiter(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '"' || c == '(' || c == ')';
+        }
+        bool rest_of_string() { // into buf. false if it goes on in the next input
+            while (p < end) {
+                char c = *p++;
+                if (escape) {
+                    if (c == 'r') c = '\r';
+                    else if (c == 'n') c = '\n';
+                    else if (c == 't') c = '\t';
+                    buf += c;
+                    escape = false;
+                }
+                else if (c == '"') {
+                    unclosed--;
+                    in_string = false;
+                    return true;
+                }
+                else if (c == '\\') {
+                    escape = true;
+                }
+                else {
+                    buf += c;
+                }
+            }
+            if (!done) return false;
+            in_string = escape = false;
+            return true;
+        }
+        void close() { // replace the items of the innermost open list with the list
+            size_t from = open.back();
+            open.pop_back();
+            node l(node::T_LIST, list_object::make(items.data() + from, items.size() - from));
+            items.resize(from);
+            items.push_back(l);
+        }
+    };
+
+    vector<string> paren::tokenize(string_view s) {
+        paren_scope ps(*this);
+        vector<string> ret;
+        reader r;
+        r.input(s);
+        r.finish();
+        string_view tok;
+        for (reader::token t = r.next(tok); t != reader::END; t = r.next(tok)) {
+            if (t == reader::OPEN) ret.push_back("(");
+            else if (t == reader::CLOSE) ret.push_back(")");
+            else if (t == reader::STRING) ret.push_back('"' + string(tok));
+            else ret.push_back(string(tok));
+        }
+        return ret;
+    }
+
+    vector<node> paren::parse(string_view s) {
+        paren_scope ps(*this);
+        gc_pause pause(gc); // nothing read is garbage
+        reader r;
+        r.input(s);
+        r.finish();
+        r.read(symbols);
+        return r.take();
+    }
+
+    // compact binary form of parsed code: a header that holds a copy of the source, compared byte for byte
+    // when read, the names of the symbols used, then the expressions in preorder. a node is a tag byte and its value; counts and lengths are
+    // varints, numbers are in the byte order of the machine, which the header records
+    enum {SER_NIL, SER_INT, SER_DOUBLE, SER_FALSE, SER_TRUE, SER_STRING, SER_SYMBOL, SER_LIST};
+    static const char SER_MAGIC[8] = {'P', 'A', 'R', 'E', 'N', 'C', 0, 3}; // format 3
+    static const uint32_t SER_ORDER = 0x01020304;
+
+    uint64_t paren::hash(string_view s) { // FNV-1a
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < s.size(); i++) {
+            h ^= (unsigned char) s[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    class byte_writer {
+    public:
+        string &out;
+        byte_writer(string &out): out(out) {}
+        void varint(uint64_t v) {
+            while (v >= 0x80) {
+                out += (char) (v | 0x80);
+                v >>= 7;
+            }
+            out += (char) v;
+        }
+        template <class T> void raw(const T &v) {out.append((const char *) &v, sizeof(v));}
+        void bytes(string_view s) {
+            varint(s.size());
+            out += s;
+        }
+    };
+
+    class byte_reader { // every read checks the bounds and returns false past the end
+    public:
+        const char *p, *end;
+        byte_reader(string_view data): p(data.data()), end(data.data() + data.size()) {}
+        bool varint(uint64_t &v) {
+            v = 0;
+            for (int shift = 0; p < end && shift < 64; shift += 7) {
+                unsigned char b = *p++;
+                v |= (uint64_t) (b & 0x7f) << shift;
+                if (b < 0x80) return true;
+            }
+            return false;
+        }
+        bool count(uint64_t &n) { // of items that take a byte at least
+            return varint(n) && n <= (uint64_t) (end - p);
+        }
+        template <class T> bool raw(T &v) {
+            if (end - p < (ptrdiff_t) sizeof(v)) return false;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            return true;
+        }
+        bool bytes(string_view &s) {
+            uint64_t n;
+            if (!varint(n) || (uint64_t) (end - p) < n) return false;
+            s = string_view(p, n);
+            p += n;
+            return true;
+        }
+        bool done() const {return p == end;}
+    };
+
+    class serializer: public byte_writer {
+    private:
+        symbol_table &symbols;
+        unordered_map<int, size_t> index; // symbol ID => index in the file
+        vector<int> used; // symbol IDs, by index
+    public:
+        serializer(string &out, symbol_table &symbols): byte_writer(out), symbols(symbols) {}
+        void collect(const node &n) { // number the symbols of n
+            if (n.type == node::T_SYMBOL && index.find(n.v_int) == index.end()) {
+                index[n.v_int] = used.size();
+                used.push_back(n.v_int);
+            }
+            else if (n.type == node::T_LIST) {
+                list_object &l = n.v_list();
+                for (size_t i = 0; i < l.size(); i++) collect(l[i]);
+            }
+        }
+        void symbol_names() {
+            varint(used.size());
+            for (size_t i = 0; i < used.size(); i++) bytes(symbols.names[used[i]]);
+        }
+        void write(const node &n) {
+            switch (n.type) {
+            case node::T_INT:
+                out += (char) SER_INT;
+                raw(n.v_int);
+                break;
+            case node::T_DOUBLE:
+                out += (char) SER_DOUBLE;
+                raw(n.v_double);
+                break;
+            case node::T_BOOL:
+                out += (char) (n.v_bool ? SER_TRUE : SER_FALSE);
+                break;
+            case node::T_STRING:
+                out += (char) SER_STRING;
+                bytes(((string_object *) n.v_obj)->view());
+                break;
+            case node::T_SYMBOL:
+                out += (char) SER_SYMBOL;
+                varint(index[n.v_int]);
+                break;
+            case node::T_LIST: {
+                list_object &l = n.v_list();
+                out += (char) SER_LIST;
+                varint(l.size());
+                for (size_t i = 0; i < l.size(); i++) write(l[i]);
+                break;}
+            default: // not made by parse
+                out += (char) SER_NIL;
+            }
+        }
+    };
+
+    string paren::serialize(const vector<node> &code, string_view source) {
+        paren_scope ps(*this);
+        string out(SER_MAGIC, sizeof(SER_MAGIC));
+        serializer w(out, symbols);
+        w.raw(SER_ORDER);
+        w.bytes(source);
+        for (size_t i = 0; i < code.size(); i++) w.collect(code[i]);
+        w.symbol_names();
+        w.varint(code.size());
+        for (size_t i = 0; i < code.size(); i++) w.write(code[i]);
+        return out;
+    }
+
+    class deserializer: public byte_reader { // reads the nodes in place from the data
+    private:
+        symbol_table &symbols;
+        vector<int> ids; // symbol ID of each index in the file
+    public:
+        vector<node> items; // the expressions, then the items of the lists being read
+        gc_root root;
+        deserializer(string_view data, symbol_table &symbols): byte_reader(data), symbols(symbols), root(items) {}
+        bool symbol_names() {
+            uint64_t n;
+            if (!varint(n)) return false;
+            for (uint64_t i = 0; i < n; i++) {
+                string_view name;
+                if (!bytes(name)) return false;
+                ids.push_back(symbols.intern(name));
+            }
+            return true;
+        }
+        bool read() { // one node onto items
+            if (p >= end) return false;
+            switch (*p++) {
+            case SER_NIL:
+                items.push_back(node());
+                return true;
+            case SER_INT: {
+                int i;
+                if (!raw(i)) return false;
+                items.push_back(node(i));
+                return true;}
+            case SER_DOUBLE: {
+                double d;
+                if (!raw(d)) return false;
+                items.push_back(node(d));
+                return true;}
+            case SER_FALSE:
+            case SER_TRUE:
+                items.push_back(node(p[-1] == SER_TRUE));
+                return true;
+            case SER_STRING: {
+                string_view s;
+                if (!bytes(s)) return false;
+                string_object *o = new string_object(s); // copied once, straight from the data
+                heap::current()->account(o->extra());
+                items.push_back(node(node::T_STRING, o));
+                return true;}
+            case SER_SYMBOL: {
+                uint64_t i;
+                if (!varint(i) || i >= ids.size()) return false;
+                node n;
+                n.type = node::T_SYMBOL;
+                n.v_int = ids[i];
+                items.push_back(n);
+                return true;}
+            case SER_LIST: {
+                uint64_t n;
+                if (!count(n)) return false;
+                size_t from = items.size();
+                for (uint64_t i = 0; i < n; i++) {
+                    if (!read()) return false;
+                }
+                node l(node::T_LIST, list_object::make(items.data() + from, n));
+                items.resize(from);
+                items.push_back(l);
+                return true;}
+            default:
+                return false;
+            }
+        }
     };
 
-    vector<node> paren::parse(const string &s) {
-        return parser(tokenize(s)).parse();
+    bool paren::deserialize(string_view data, string_view source, vector<node> &code) {
+        paren_scope ps(*this);
+        gc_pause pause(gc); // nothing read is garbage
+        deserializer r(data, symbols);
+        char magic[sizeof(SER_MAGIC)];
+        uint32_t order;
+        uint64_t n;
+        string_view from; // the source the data was made from
+        if (!r.raw(magic) || memcmp(magic, SER_MAGIC, sizeof(magic)) != 0) return false;
+        if (!r.raw(order) || order != SER_ORDER) return false;
+        if (!r.bytes(from) || from != source) return false;
+        if (!r.symbol_names() || !r.varint(n)) return false;
+        for (uint64_t i = 0; i < n; i++) {
+            if (!r.read()) return false;
+        }
+        if (!r.done()) return false;
+        code.swap(r.items);
+        return true;
+    }
+
+    symbol_names::~symbol_names() {
+        for (size_t i = 0; i < size(); i += CHUNK) delete[] chunks[i >> CHUNK_BITS];
     }
 
-    environment::environment(): outer(NULL) {}
-    environment::environment(environment *outer): outer(outer) {}
+    void symbol_names::push_back(string_view name) {
+        size_t id = size();
+        if (id >= (size_t) CHUNKS * CHUNK) throw length_error("too many symbols");
+        if ((id & (CHUNK - 1)) == 0) chunks[id >> CHUNK_BITS] = new string[CHUNK];
+        chunks[id >> CHUNK_BITS][id & (CHUNK - 1)] = name;
+        count.store(id + 1, memory_order_release);
+    }
+
+    symbol_table &symbol_table::global() {
+        static symbol_table *symbols = new symbol_table; // never destroyed: nodes may outlive static destructors
+        return *symbols;
+    }
+
+    int symbol_table::intern(string_view name) {
+        lock_guard<mutex> l(lock);
+        auto found = ids.find(name);
+        if (found != ids.end()) return found->second;
+        int id = names.size();
+        names.push_back(string(name));
+        ids[names.back()] = id;
+        return id;
+    }
+
+    environment::environment(): slots(NULL), sc(NULL), outer(NULL) {}
+    environment::environment(environment *outer, scope *sc, node *slots):
+        slots(slots), sc(sc), outer(outer) {
+        int n = sc->names.size();
+        for (int i = 0; i < n; i++) slots[i] = node();
+    }
 
-    node &environment::get(const string &name) {
-        auto found = env.find(name);
+    node *environment::find(int id) {
+        if (sc) {
+            int n = sc->names.size();
+            for (int i = 0; i < n; i++) {
+                if (sc->names[i] == id && slots[i].type != node::T_NIL) return &slots[i];
+            }
+        }
+        auto found = env.find(id);
         if (found != env.end()) {
-            return found->second;
+            return &found->second;
         }
         else {
             if (outer != NULL) {
-                return outer->get(name);
+                return outer->find(id);
             }
             else {
-                return nil;
+                return NULL;
             }
         }
     }
 
-    node builtin(int b) {
-        node n(b);
-        n.type = node::T_BUILTIN;
-        return n;
+    atomic<unsigned int> environment::version(0);
+
+    node &environment::define(int id) {
+        if (sc) {
+            int n = sc->names.size();
+            for (int i = 0; i < n; i++) {
+                if (sc->names[i] == id) return slots[i];
+            }
+        }
+        if (outer != NULL && env.find(id) == env.end()) version++; // may hide a global that a call site cached
+        return env[id];
     }
 
-    node fn(node n, environment *outer_env) {
-        node n2(n);
-        n2.type = node::T_FN;
-        n2.env = shared_ptr<void>(new environment(outer_env));
-        return n2;
+    void environment::trace(heap &h) {
+        h.mark(sc);
+        h.mark(outer);
+        if (sc) {
+            int n = sc->names.size();
+            for (int i = 0; i < n; i++) h.mark(slots[i]);
+        }
+        for (auto iter = env.begin(); iter != env.end(); iter++) h.mark(iter->second);
     }
 
-    node paren::eval(node &n, environment &env) {
-        switch (n.type) {
-        case node::T_NIL:
-        case node::T_INT:
-        case node::T_DOUBLE:
-        case node::T_BOOL:
-        case node::T_STRING:
-        case node::T_BUILTIN:
-            {
-                return n;
+    void list_leaf::trace(heap &h) {
+        for (int i = 0; i < 32; i++) h.mark(items[i]);
+    }
+
+    void list_branch::trace(heap &h) {
+        for (int i = 0; i < 32; i++) h.mark(child[i]);
+    }
+
+    void list_object::trace(heap &h) {
+        for (unsigned int i = 0; i < tail_size; i++) h.mark(tail()[i]);
+        h.mark(root);
+        h.mark(sc);
+    }
+
+    list_object::list_object(): count(0), start(0), tail_off(0), shift(5), tail_size(0), root(NULL), sc(NULL) {}
+
+    list_object &list_object::empty_list() {
+        static list_object empty;
+        return empty;
+    }
+
+    list_object *list_object::alloc(size_t tail_size) {
+        list_object *l = new (heap::current()->alloc(sizeof(list_object) + tail_size * sizeof(node))) list_object;
+        for (size_t i = 0; i < tail_size; i++) l->tail()[i] = node();
+        l->tail_size = tail_size;
+        return l;
+    }
+
+    list_leaf *list_object::leaf(size_t p) const {
+        object *o = root;
+        for (unsigned int level = shift; level > 0; level -= 5) o = ((list_branch *) o)->child[(p >> level) & 31];
+        return (list_leaf *) o;
+    }
+
+    node &list_object::at(size_t i) const {
+        if (i >= count) throw out_of_range("list index out of range");
+        return (*this)[i];
+    }
+
+    // the trie under b (a branch at level, or NULL) with leaf at position pos. copies the path unless in_place
+    static list_branch *put_leaf(object *b, unsigned int level, size_t pos, list_leaf *leaf, bool in_place) {
+        list_branch *br = (list_branch *) b;
+        if (br == NULL) {
+            br = new list_branch;
+        }
+        else if (!in_place) {
+            br = new list_branch;
+            memcpy(br->child, ((list_branch *) b)->child, sizeof(br->child));
+        }
+        size_t i = (pos >> level) & 31;
+        object *child = level == 5 ? (object *) leaf : put_leaf(br->child[i], level - 5, pos, leaf, in_place);
+        br->child[i] = child;
+        return br;
+    }
+
+    static void push_leaf(list_object *l, list_leaf *leaf, size_t pos, bool in_place) {
+        while ((pos >> 5) >= ((size_t) 1 << l->shift)) { // the trie is full: add a level
+            list_branch *r = new list_branch;
+            r->child[0] = l->root;
+            l->root = r;
+            l->shift += 5;
+        }
+        l->root = put_leaf(l->root, l->shift, pos, leaf, in_place);
+    }
+
+    // the trie under o (a branch at level, or a leaf at level 0) with position p set to x
+    static object *put_item(object *o, unsigned int level, size_t p, const node &x) {
+        if (level == 0) {
+            list_leaf *leaf = new list_leaf;
+            for (int i = 0; i < 32; i++) leaf->items[i] = ((list_leaf *) o)->items[i];
+            leaf->items[p & 31] = x;
+            return leaf;
+        }
+        list_branch *br = new list_branch;
+        memcpy(br->child, ((list_branch *) o)->child, sizeof(br->child));
+        size_t i = (p >> level) & 31;
+        object *child = put_item(br->child[i], level - 5, p, x);
+        br->child[i] = child;
+        return br;
+    }
+
+    list_object *list_object::make(const node *items, size_t n) {
+        size_t off = n == 0 ? 0 : ((n - 1) >> 5) << 5;
+        list_object *l = alloc(n - off);
+        for (size_t i = off; i < n; i++) l->tail()[i - off] = items[i];
+        l->count = n;
+        l->tail_off = off;
+        for (size_t p = 0; p < off; p += 32) {
+            list_leaf *leaf = new list_leaf;
+            for (int i = 0; i < 32; i++) leaf->items[i] = items[p + i];
+            push_leaf(l, leaf, p, true);
+        }
+        return l;
+    }
+
+    list_object *list_object::conj(const node &x) const {
+        if (count == 0) return make(&x, 1);
+        list_object *l;
+        if (tail_size < 32) {
+            l = alloc(tail_size + 1);
+            for (unsigned int i = 0; i < tail_size; i++) l->tail()[i] = tail()[i];
+            l->tail()[tail_size] = x;
+            l->tail_off = tail_off;
+            l->shift = shift;
+            l->root = root;
+        }
+        else { // the tail is full: it becomes a leaf of the trie
+            list_leaf *full = new list_leaf;
+            for (int i = 0; i < 32; i++) full->items[i] = tail()[i];
+            l = alloc(1);
+            l->tail()[0] = x;
+            l->tail_off = start + count;
+            l->shift = shift;
+            l->root = root;
+            push_leaf(l, full, tail_off, false);
+        }
+        l->start = start;
+        l->count = count + 1;
+        return l;
+    }
+
+    list_object *list_object::assoc(size_t i, const node &x) const {
+        list_object *l = alloc(tail_size);
+        for (unsigned int j = 0; j < tail_size; j++) l->tail()[j] = tail()[j];
+        l->start = start;
+        l->count = count;
+        l->tail_off = tail_off;
+        l->shift = shift;
+        l->root = root;
+        size_t p = start + i;
+        if (p >= tail_off) l->tail()[p - tail_off] = x;
+        else l->root = put_item(root, shift, p, x);
+        return l;
+    }
+
+    list_object *list_object::slice(size_t from, size_t to) const {
+        if (to > count) to = count;
+        if (from >= to) return make(NULL, 0);
+        size_t s = start + from, e = start + to;
+        size_t off = ((e - 1) >> 5) << 5;
+        list_object *l = alloc(e - off);
+        for (size_t p = off; p < e; p++) l->tail()[p - off] = p < s ? node() : (*this)[p - start];
+        l->start = s;
+        l->count = to - from;
+        l->tail_off = off;
+        if (s < off) { // share the trie. positions outside the slice stay reachable but unused
+            l->shift = shift;
+            l->root = root;
+        }
+        return l;
+    }
+
+    const string &string_object::flatten() {
+        static mutex lock; // of flattening while the heap is shared
+        unique_lock<mutex> l(lock, defer_lock);
+        if (heap::current()->shared) l.lock();
+        string_object *b = buf;
+        if (b != NULL) {
+            v.assign(b->v, 0, len);
+            buf = NULL; // after v, for the threads that read v once they see no buffer
+            heap::current()->account(v.capacity());
+        }
+        return v;
+    }
+
+    void string_object::trace(heap &h) {
+        h.mark(buf);
+    }
+
+    void fn_object::trace(heap &h) {
+        h.mark(code);
+        h.mark(env);
+    }
+
+    seq_object::seq_object(paren *owner, const node &from, const node &last, const node &step):
+        from(from), last(last), step(step), items(NULL), owner(owner) {}
+
+    seq_object *seq_object::then(const node &f, bool filter) const {
+        seq_object *s = new seq_object(owner, from, last, step);
+        s->stages.reserve(stages.size() + 1);
+        s->stages = stages;
+        stage st = {f, filter};
+        s->stages.push_back(st);
+        heap::current()->account(s->extra());
+        return s;
+    }
+
+    // calls visit(x) for each item x of s, in order
+    template <class F> void each(seq_object &s, F visit) {
+        paren &p = *s.owner;
+        unsigned int n = s.stages.size();
+        auto emit = [&](node x) {
+            for (unsigned int i = 0; i < n; i++) {
+                const seq_object::stage &st = s.stages[i];
+                if (!st.filter) x = p.call(st.f, &x, 1, p.global_env);
+                else if (!p.call(st.f, &x, 1, p.global_env).v_bool) return;
             }
-        case node::T_SYMBOL:
-            {
-                node &n2 = env.get(n.v_string);
-                if (n2.type != node::T_NIL)
-                    return n2;
-                else {
-                    auto found = builtin_map.find(n.v_string);
-                    if (found != builtin_map.end()) {
-                        n = builtin(found->second); // elementary just-in-time compilation
-                        return n;
-                    }
-                    else {
-                        cerr << "Unknown variable: " << n.v_string << endl;
-                        return nil;
-                    }
-                }
+            visit(x);
+        };
+        if (s.from.type == node::T_INT) {
+            int a = s.from.v_int, last = s.last.v_int, step = s.step.v_int;
+            if (step >= 0) {
+                for (; a <= last; a += step) emit(node(a));}
+            else {
+                for (; a >= last; a += step) emit(node(a));}
+        }
+        else {
+            double a = s.from.v_double, last = s.last.v_double, step = s.step.v_double;
+            if (step >= 0) {
+                for (; a <= last; a += step) emit(node(a));}
+            else {
+                for (; a >= last; a += step) emit(node(a));}
+        }
+    }
+
+    list_object &seq_object::list() {
+        list_object *l = items.load(memory_order_acquire);
+        if (l == NULL) {
+            paren_scope ps(*owner);
+            vector<node> acc;
+            gc_root root(acc);
+            each(*this, [&](const node &x) {acc.push_back(x);});
+            l = list_object::make(acc.data(), acc.size());
+            list_object *none = NULL;
+            if (!items.compare_exchange_strong(none, l, memory_order_acq_rel)) l = none; // realized by another worker first
+        }
+        return *l;
+    }
+
+    // an int if x fits in one, else the nearest double. so i64vec items read as they print
+    static node int64_node(int64_t x) {
+        return x >= INT_MIN && x <= INT_MAX ? node((int) x) : node((double) x);
+    }
+
+    // d truncated to an i64vec item, clamped to the range of int64. NaN is 0
+    static int64_t int64_of(double d) {
+        if (d != d) return 0;
+        if (d >= 9223372036854775807.0) return INT64_MAX;
+        if (d <= -9223372036854775808.0) return INT64_MIN;
+        return (int64_t) d;
+    }
+
+    node vec_object::at(size_t i) const {
+        if (i >= size()) throw out_of_range("vector index out of range");
+        return ints ? int64_node(i64[i]) : node(f64[i]);
+    }
+
+    list_object &vec_object::list() {
+        list_object *l = items.load(memory_order_acquire);
+        if (l == NULL) {
+            vector<node> acc(size());
+            for (size_t i = 0; i < acc.size(); i++) acc[i] = at(i);
+            l = list_object::make(acc.data(), acc.size());
+            list_object *none = NULL;
+            if (!items.compare_exchange_strong(none, l, memory_order_acq_rel)) l = none; // made by another worker first
+        }
+        return *l;
+    }
+
+    void vec_object::trace(heap &h) {
+        h.mark(items.load(memory_order_relaxed));
+    }
+
+    void seq_object::trace(heap &h) {
+        for (unsigned int i = 0; i < stages.size(); i++) h.mark(stages[i].f);
+        h.mark(items.load(memory_order_relaxed));
+    }
+
+    // a frame that outlives its call, on the heap
+    environment *heap_frame(heap &h, environment *outer, scope *sc) {
+        void *mem = h.alloc(sizeof(environment) + sc->names.size() * sizeof(node));
+        return new (mem) environment(outer, sc, (node *) ((environment *) mem + 1));
+    }
+
+    frame_arena::~frame_arena() {
+        for (unsigned int i = 0; i < blocks.size(); i++) free(blocks[i].first);
+    }
 
+    void *frame_arena::alloc(size_t n) {
+        n = (n + 15) & ~(size_t) 15;
+        if (blocks.empty() || used + n > blocks[block].second) {
+            if (!blocks.empty()) block++;
+            if (block == blocks.size() || blocks[block].second < n) {
+                size_t size = max(n, (size_t) 65536);
+                blocks.insert(blocks.begin() + block, make_pair((char *) malloc(size), size));
             }
-        case node::T_LIST: // function (FUNCTION ARGUMENT ..)
-            {
-                if (n.v_list.size() == 0) return node();
-                node func = eval(n.v_list[0], env);
-                int builtin = -1;
-                if (func.type == node::T_BUILTIN) {
-                    builtin = func.v_int;
-                    switch(builtin) {
-                        case node::PLUS: // (+ X ..)
-                            {
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    int sum = first.v_int;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum += eval(*i, env).to_int();
-                                    }
-                                    return node(sum);
-                                }
-                                else {
-                                    double sum = first.v_double;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum += eval(*i, env).to_double();
-                                    }
-                                    return node(sum);
-                                }
-                            }
-                        case node::MINUS: // (- X ..)
-                            {
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    int sum = first.v_int;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum -= eval(*i, env).to_int();
-                                    }
-                                    return node(sum);
-                                }
-                                else {
-                                    double sum = first.v_double;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum -= eval(*i, env).to_double();
-                                    }
-                                    return node(sum);
-                                }
-                            }
-                        case node::MUL: // (* X ..)
-                            {
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(1);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    int sum = first.v_int;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum *= eval(*i, env).to_int();
-                                    }
-                                    return node(sum);
-                                }
-                                else {
-                                    double sum = first.v_double;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        sum *= eval(*i, env).to_double();
-                                    }
-                                    return node(sum);
-                                }
-                            }
-                        case node::DIV: // (/ X ..)
-                            {
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(1);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    int acc = first.v_int;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        acc /= eval(*i, env).to_int();
+            used = 0;
+        }
+        void *p = blocks[block].first + used;
+        used += n;
+        return p;
+    }
+
+    // heap pages are PAGE_SIZE-aligned: a header, then slots of one size class
+    static const size_t PAGE_SIZE = 65536;
+    static const size_t SLOT_ALIGN = 16;
+    static const size_t SIZE_CLASSES = 64; // slots of 16, 32, .. 1024 bytes. larger objects are allocated alone
+
+    struct heap::page {
+        size_t slot_size;
+        size_t count; // number of slots
+        char *first; // first slot
+        unsigned char bits[PAGE_SIZE / SLOT_ALIGN / 8]; // allocated slots
+        bool allocated(size_t i) const {return (bits[i >> 3] >> (i & 7)) & 1;}
+        void set(size_t i) {bits[i >> 3] |= 1 << (i & 7);}
+        void clear(size_t i) {bits[i >> 3] &= ~(1 << (i & 7));}
+    };
+
+    static void *alloc_page() {
+#if defined(_WIN32)
+        return _aligned_malloc(PAGE_SIZE, PAGE_SIZE);
+#else
+        void *p = NULL;
+        return posix_memalign(&p, PAGE_SIZE, PAGE_SIZE) == 0 ? p : NULL;
+#endif
+    }
+
+    static void free_page(void *p) {
+#if defined(_WIN32)
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+    // every heap alive, by serial. a serial is never reused, unlike the address of a destroyed heap
+    static mutex heaps_lock;
+    static uint64_t heaps_made = 0;
+    static unordered_map<uint64_t, heap *> &live_heaps() {
+        static unordered_map<uint64_t, heap *> *heaps = new unordered_map<uint64_t, heap *>;
+        return *heaps;
+    }
+
+    heap::heap(): heap_size(8 << 20), shared(0), paused(0), epoch(0), survived(0), free_slots(SIZE_CLASSES), low(UINTPTR_MAX), high(0) {
+        memset(&stats, 0, sizeof(stats));
+        lock_guard<mutex> l(heaps_lock);
+        serial = ++heaps_made;
+        outer_serial = current() != NULL ? current()->serial : 0;
+        live_heaps()[serial] = this;
+    }
+
+    heap::~heap() {
+        {
+            lock_guard<mutex> l(heaps_lock);
+            live_heaps().erase(serial);
+            for (auto i = live_heaps().begin(); i != live_heaps().end(); ++i) { // skip this in the chain of outer heaps
+                if (i->second->outer_serial == serial) i->second->outer_serial = outer_serial;
+            }
+        }
+        for (unsigned int i = 0; i < pages.size(); i++) {
+            page *pg = pages[i];
+            for (size_t j = 0; j < pg->count; j++) {
+                if (pg->allocated(j)) ((object *) (pg->first + j * pg->slot_size))->~object();
+            }
+            free_page(pg);
+        }
+        for (auto iter = large.begin(); iter != large.end(); iter++) {
+            ((object *) iter->first)->~object();
+            free((void *) iter->first);
+        }
+    }
+
+    heap *&heap::current() {
+        static thread_local heap *h = NULL;
+        return h;
+    }
+
+    heap *heap::outer() const {
+        lock_guard<mutex> l(heaps_lock);
+        auto found = live_heaps().find(outer_serial);
+        return found != live_heaps().end() ? found->second : NULL;
+    }
+
+    bool heap::owns(const object *o) const {
+        uintptr_t w = (uintptr_t) o;
+        if (w < low || w >= high) return false;
+        return page_of.count(w & ~(PAGE_SIZE - 1)) != 0 || large.count(w) != 0;
+    }
+
+    bool &heap::worker() {
+        static thread_local bool w = false;
+        return w;
+    }
+
+    void *object::operator new(size_t size) {
+        heap *h = heap::current();
+        if (h == NULL) {
+            cerr << "No paren heap on this thread" << endl;
+            abort();
+        }
+        return h->alloc(size);
+    }
+
+    void heap::new_page(size_t size_class) {
+        char *mem = (char *) alloc_page();
+        if (mem == NULL) throw bad_alloc();
+        page *pg = (page *) mem;
+        pg->slot_size = (size_class + 1) * SLOT_ALIGN;
+        pg->first = mem + ((sizeof(page) + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1));
+        pg->count = (mem + PAGE_SIZE - pg->first) / pg->slot_size;
+        memset(pg->bits, 0, sizeof(pg->bits));
+        pages.push_back(pg);
+        page_of[(uintptr_t) mem] = pg;
+        low = min(low, (uintptr_t) mem);
+        high = max(high, (uintptr_t) mem + PAGE_SIZE);
+        for (size_t i = pg->count; i-- > 0;) {
+            void *slot = pg->first + i * pg->slot_size;
+            *(void **) slot = free_slots[size_class];
+            free_slots[size_class] = slot;
+        }
+    }
+
+    void *heap::alloc(size_t size) {
+        if (shared) {
+            lock_guard<mutex> l(lock);
+            return take(size);
+        }
+        if (stats.live_bytes >= heap_size && stats.live_bytes >= survived * 2 && !paused) collect();
+        return take(size);
+    }
+
+    void *heap::take(size_t size) {
+        size = (size + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+        stats.allocated_objects++;
+        stats.live_objects++;
+        stats.live_bytes += size;
+        stats.allocated_bytes += size;
+        if (size > SLOT_ALIGN * SIZE_CLASSES) {
+            void *p = malloc(size);
+            if (p == NULL) throw bad_alloc();
+            large[(uintptr_t) p] = size;
+            low = min(low, (uintptr_t) p);
+            high = max(high, (uintptr_t) p + size);
+            return p;
+        }
+        size_t c = size / SLOT_ALIGN - 1;
+        if (free_slots[c] == NULL) new_page(c);
+        char *p = (char *) free_slots[c];
+        free_slots[c] = *(void **) p;
+        page *pg = (page *) ((uintptr_t) p & ~(PAGE_SIZE - 1));
+        pg->set((p - pg->first) / pg->slot_size);
+        return p;
+    }
+
+    // marks the object that w points into, if any
+    inline void heap::mark_word(uintptr_t w) {
+        if (w < low || w >= high) return;
+        auto found = page_of.find(w & ~(PAGE_SIZE - 1));
+        if (found != page_of.end()) {
+            page *pg = found->second;
+            if (w < (uintptr_t) pg->first) return;
+            size_t i = (w - (uintptr_t) pg->first) / pg->slot_size;
+            if (i < pg->count && pg->allocated(i)) mark((object *) (pg->first + i * pg->slot_size));
+            return;
+        }
+        auto next = large.upper_bound(w);
+        if (next == large.begin()) return;
+        --next;
+        if (w < next->first + next->second) mark((object *) next->first);
+    }
+
+    static char *stack_top() { // highest address of the stack of this thread
+        static thread_local char *top = NULL;
+        if (top != NULL) return top;
+#if defined(_WIN32)
+        top = (char *) ((NT_TIB *) NtCurrentTeb())->StackBase;
+#elif defined(__APPLE__)
+        top = (char *) pthread_get_stackaddr_np(pthread_self());
+#else
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        top = (char *) addr + size;
+#endif
+        return top;
+    }
+
+    void heap::scan_stack() {
+#if defined(__GNUC__)
+        __builtin_unwind_init(); // spill callee-saved registers into this frame
+#else
+        jmp_buf regs;
+        setjmp(regs);
+#endif
+        scan_from_here();
+    }
+
+#if defined(__GNUC__)
+    __attribute__((noinline, no_sanitize_address))
+#elif defined(_MSC_VER)
+    __declspec(noinline)
+#endif
+    void heap::scan_from_here() { // every word from this frame to the top of the stack
+        void *volatile here = NULL;
+        uintptr_t *p = (uintptr_t *) ((uintptr_t) &here & ~(uintptr_t) (sizeof(void *) - 1));
+        uintptr_t *top = (uintptr_t *) stack_top();
+        for (; p < top; p++) mark_word(*p);
+    }
+
+    void heap::sweep() {
+        stats.live_objects = 0;
+        stats.live_bytes = 0;
+        for (size_t c = 0; c < SIZE_CLASSES; c++) free_slots[c] = NULL;
+        low = UINTPTR_MAX;
+        high = 0;
+        vector<page *> kept;
+        for (unsigned int i = 0; i < pages.size(); i++) {
+            page *pg = pages[i];
+            size_t used = 0;
+            for (size_t j = 0; j < pg->count; j++) {
+                if (!pg->allocated(j)) continue;
+                object *o = (object *) (pg->first + j * pg->slot_size);
+                if (o->mark == epoch) {
+                    used++;
+                    stats.live_bytes += pg->slot_size + o->extra();
+                    continue;
+                }
+                o->~object();
+                pg->clear(j);
+                stats.freed_objects++;
+            }
+            if (used == 0) { // give empty pages back
+                page_of.erase((uintptr_t) pg);
+                free_page(pg);
+                continue;
+            }
+            stats.live_objects += used;
+            kept.push_back(pg);
+            low = min(low, (uintptr_t) pg);
+            high = max(high, (uintptr_t) pg + PAGE_SIZE);
+            size_t c = pg->slot_size / SLOT_ALIGN - 1;
+            for (size_t j = pg->count; j-- > 0;) {
+                if (pg->allocated(j)) continue;
+                void *slot = pg->first + j * pg->slot_size;
+                *(void **) slot = free_slots[c];
+                free_slots[c] = slot;
+            }
+        }
+        pages.swap(kept);
+        for (auto iter = large.begin(); iter != large.end();) {
+            object *o = (object *) iter->first;
+            if (o->mark == epoch) {
+                stats.live_objects++;
+                stats.live_bytes += iter->second + o->extra();
+                low = min(low, iter->first);
+                high = max(high, iter->first + iter->second);
+                ++iter;
+                continue;
+            }
+            o->~object();
+            free(o);
+            stats.freed_objects++;
+            iter = large.erase(iter);
+        }
+    }
+
+    void heap::collect() {
+        auto start = chrono::steady_clock::now();
+        if (++epoch == 0) epoch = 1; // 0 is the mark of new objects
+        for (unsigned int i = 0; i < envs.size(); i++) mark(envs[i]);
+        for (unsigned int i = 0; i < calls.size(); i++) {
+            mark(calls[i].env);
+            mark(calls[i].fn);
+        }
+        for (unsigned int i = 0; i < roots.size(); i++) {
+            vector<node> &v = *roots[i];
+            for (unsigned int j = 0; j < v.size(); j++) mark(v[j]);
+        }
+        scan_stack();
+        while (!gray.empty()) {
+            object *o = gray.back();
+            gray.pop_back();
+            o->trace(*this);
+        }
+        sweep();
+        survived = stats.live_bytes;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        stats.collections++;
+        stats.pause_ms += ms;
+        stats.max_pause_ms = max(stats.max_pause_ms, ms);
+    }
+
+    // the variable that a T_SYMBOL or T_LOCAL refers to, NULL if unbound
+    inline node *variable(node &sym, environment &env) {
+        if (sym.type == node::T_LOCAL) {
+            environment *e = &env;
+            for (int d = sym.v_addr.depth; d > 0; d--) e = e->outer;
+            node &v = e->slots[sym.v_addr.slot];
+            if (v.type != node::T_NIL || e->outer == NULL) return &v;
+            return e->outer->find(sym.v_addr.id); // not set yet in this call: outer scopes
+        }
+        return env.find(sym.v_int);
+    }
+
+    // the variable that (set SYMBOL ..) or (for SYMBOL ..) assigns in env
+    inline node &binding(node &sym, environment &env) {
+        if (sym.type == node::T_LOCAL) return env.slots[sym.v_addr.slot];
+        return env.define(sym.v_int);
+    }
+
+    node clone(const node &n) { // deep copy of lists
+        if (n.type != node::T_LIST) return n;
+        list_object &v = n.v_list();
+        vector<node> ret;
+        gc_root root(ret);
+        ret.reserve(v.size());
+        for (unsigned int i = 0; i < v.size(); i++) ret.push_back(clone(v[i]));
+        return node(std::move(ret));
+    }
+
+    node builtin(int b) {
+        node n(b);
+        n.type = node::T_BUILTIN;
+        return n;
+    }
+
+    inline list_object *list_of(const node &n) {
+        return (list_object *) n.v_obj;
+    }
+
+    inline string_object *str_of(const node &n) {
+        return (string_object *) n.v_obj;
+    }
+
+    // (strcat A ..) of first A and the rest s: appended to the buffer of A in place if A is the longest
+    // view of it, else copied into a new buffer. the buffers are not grown while shared with the pool
+    static node append(paren &p, const node &first, string_view s) {
+        string_object *a = first.type == node::T_STRING ? str_of(first) : NULL;
+        string_object *buf = a != NULL && !p.gc.shared ? a->buf.load() : NULL;
+        if (buf != NULL && a->len == buf->v.size()) {
+            size_t capacity = buf->v.capacity();
+            buf->v += s;
+            p.gc.account(buf->v.capacity() - capacity);
+        }
+        else {
+            string v = a != NULL ? string(a->view()) : node(first).to_str();
+            v += s;
+            buf = str_of(node(v));
+        }
+        return node(node::T_STRING, new string_object(buf, buf->v.size()));
+    }
+
+    // maps. a key is hashed by its type and value, a string by its text: 57 bits pick the group that
+    // probing starts from, and 7 are kept in the control byte of its slot, that only keys of the same
+    // bits are compared with. EMPTY and DELETED are negative, so that a group is searched for a free
+    // slot by the sign bits of its bytes
+    enum {CTRL_EMPTY = -128, CTRL_DELETED = -2};
+
+    static bool is_key(const node &k) {
+        return k.type == node::T_INT || k.type == node::T_DOUBLE || k.type == node::T_STRING || k.type == node::T_SYMBOL
+            || k.type == node::T_BOOL;
+    }
+
+    static uint64_t key_hash(const node &k) {
+        uint64_t h;
+        switch (k.type) {
+        case node::T_STRING:
+            h = paren::hash(str_of(k)->view()); break;
+        case node::T_DOUBLE: {
+            double d = k.v_double == 0 ? 0.0 : k.v_double != k.v_double ? NAN : k.v_double; // one zero and one NaN
+            memcpy(&h, &d, sizeof(h));
+            break;}
+        case node::T_BOOL:
+            h = k.v_bool; break;
+        default:
+            h = (uint32_t) k.v_int;
+        }
+        h += (uint64_t) k.type * 0x9e3779b97f4a7c15ULL; // the splitmix64 finalizer, over the type and value
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    static bool same_key(const node &a, const node &b) {
+        if (a.type != b.type) return false;
+        switch (a.type) {
+        case node::T_STRING: return a.v_obj == b.v_obj || str_of(a)->view() == str_of(b)->view();
+        case node::T_DOUBLE: return a.v_double == b.v_double || (a.v_double != a.v_double && b.v_double != b.v_double);
+        case node::T_BOOL: return a.v_bool == b.v_bool;
+        default: return a.v_int == b.v_int;
+        }
+    }
+
+    // bit i set if control byte i of the group at c is b
+    static inline uint32_t match(const signed char *c, signed char b) {
+#ifdef __SSE2__
+        __m128i g = _mm_loadu_si128((const __m128i *) c);
+        return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b)));
+#else
+        uint32_t m = 0;
+        for (int i = 0; i < map_object::GROUP; i++) m |= (uint32_t) (c[i] == b) << i;
+        return m;
+#endif
+    }
+
+    // bit i set if slot i of the group at c is empty or deleted
+    static inline uint32_t match_free(const signed char *c) {
+#ifdef __SSE2__
+        return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) c));
+#else
+        uint32_t m = 0;
+        for (int i = 0; i < map_object::GROUP; i++) m |= (uint32_t) (c[i] < 0) << i;
+        return m;
+#endif
+    }
+
+    static inline int lowest_bit(uint32_t m) {
+#ifdef __GNUC__
+        return __builtin_ctz(m);
+#else
+        int i = 0;
+        for (; (m & 1) == 0; m >>= 1) i++;
+        return i;
+#endif
+    }
+
+    map_object::map_object(): count(0), growth(0) {}
+
+    // the slot of key, whose hash is h, or slots.size() if it is not in. groups are probed by triangular
+    // numbers, that visit each of a power of 2 of them; there is always an empty slot to stop at
+    size_t map_object::lookup(const node &key, uint64_t h) const {
+        if (count == 0) return slots.size();
+        size_t mask = slots.size() / GROUP - 1, g = (h >> 7) & mask;
+        for (size_t step = 1; ; step++) {
+            const signed char *c = &ctrl[g * GROUP];
+            for (uint32_t m = match(c, h & 0x7f); m != 0; m &= m - 1) {
+                size_t i = g * GROUP + lowest_bit(m);
+                if (same_key(slots[i].key, key)) return i;
+            }
+            if (match(c, CTRL_EMPTY) != 0) return slots.size();
+            g = (g + step) & mask;
+        }
+    }
+
+    // the first empty or deleted slot on the probe sequence of h
+    size_t map_object::free_slot(uint64_t h) const {
+        size_t mask = slots.size() / GROUP - 1, g = (h >> 7) & mask;
+        for (size_t step = 1; ; step++) {
+            uint32_t m = match_free(&ctrl[g * GROUP]);
+            if (m != 0) return g * GROUP + lowest_bit(m);
+            g = (g + step) & mask;
+        }
+    }
+
+    node *map_object::find(const node &key) {
+        size_t i = lookup(key, key_hash(key));
+        return i < slots.size() ? &slots[i].value : NULL;
+    }
+
+    node &map_object::put(const node &key) {
+        uint64_t h = key_hash(key);
+        size_t i = lookup(key, h);
+        if (i < slots.size()) return slots[i].value;
+        if (growth == 0) {
+            size_t capacity = GROUP;
+            while (capacity * 7 / 8 <= count * 2) capacity *= 2; // at most half full after; else only the deleted are dropped
+            rebuild(capacity);
+        }
+        i = free_slot(h);
+        if (ctrl[i] == CTRL_EMPTY) growth--;
+        ctrl[i] = h & 0x7f;
+        slots[i].key = key;
+        slots[i].value = node();
+        count++;
+        return slots[i].value;
+    }
+
+    // a slot becomes empty again if its group has an empty slot: then no probe has gone past the group
+    // since the table was built, else deleted, that keeps probes going
+    bool map_object::remove(const node &key) {
+        size_t i = lookup(key, key_hash(key));
+        if (i == slots.size()) return false;
+        if (match(&ctrl[i / GROUP * GROUP], CTRL_EMPTY) != 0) {
+            ctrl[i] = CTRL_EMPTY;
+            growth++;
+        }
+        else {
+            ctrl[i] = CTRL_DELETED;
+        }
+        slots[i] = slot();
+        count--;
+        return true;
+    }
+
+    void map_object::rebuild(size_t capacity) {
+        size_t before = extra();
+        vector<signed char> old_ctrl(capacity, CTRL_EMPTY);
+        vector<slot> old_slots(capacity);
+        ctrl.swap(old_ctrl);
+        slots.swap(old_slots);
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            if (old_ctrl[i] < 0) continue;
+            size_t j = free_slot(key_hash(old_slots[i].key));
+            ctrl[j] = old_ctrl[i];
+            slots[j] = old_slots[i];
+        }
+        growth = capacity * 7 / 8 - count;
+        if (extra() > before) heap::current()->account(extra() - before);
+    }
+
+    void map_object::trace(heap &h) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (ctrl[i] < 0) continue;
+            h.mark(slots[i].key);
+            h.mark(slots[i].value);
+        }
+    }
+
+    inline map_object *map_of(const node &n) {
+        return (map_object *) n.v_obj;
+    }
+
+    // m as a map, and k as a key of it, or false after an error
+    static bool map_args(paren &p, const node &m, const node &k) {
+        if (m.type != node::T_MAP) {
+            *p.err << "Not a map: " << node(m).str_with_type() << endl;
+            return false;
+        }
+        if (!is_key(k)) {
+            *p.err << "Invalid key: " << node(k).str_with_type() << endl;
+            return false;
+        }
+        return true;
+    }
+
+    inline seq_object *seq_of(const node &n) {
+        return (seq_object *) n.v_obj;
+    }
+
+    inline bool streams(const node &n) { // if n is a seq whose items can be produced without realizing it
+        return n.type == node::T_SEQ && seq_of(n)->items == NULL;
+    }
+
+    // (apply OP SEQ) for OP in + - * /, left folded as the items are produced. the first item decides
+    // between int and double arithmetic, as when the items are arguments
+    node fold(seq_object &s, int op) {
+        bool first = true, is_int = true;
+        int ai = op == node::PLUS || op == node::MINUS ? 0 : 1;
+        double ad = ai;
+        each(s, [&](const node &x) {
+            if (first) {
+                first = false;
+                is_int = x.type == node::T_INT;
+                ai = x.v_int;
+                ad = x.v_double;
+                return;
+            }
+            node y = x;
+            if (is_int) {
+                int b = y.to_int();
+                switch (op) {
+                case node::PLUS: ai += b; break;
+                case node::MINUS: ai -= b; break;
+                case node::MUL: ai *= b; break;
+                default: ai /= b; break;
+                }
+            }
+            else {
+                double b = y.to_double();
+                switch (op) {
+                case node::PLUS: ad += b; break;
+                case node::MINUS: ad -= b; break;
+                case node::MUL: ad *= b; break;
+                default: ad /= b; break;
+                }
+            }
+        });
+        if (first || is_int) return node(ai);
+        return node(ad);
+    }
+
+    // kernels of the vector arithmetic. on x86-64 each is compiled twice, for SSE2, that every such CPU
+    // has, and for AVX2, used if the CPU has it. elsewhere they are plain loops
+#ifdef PAREN_AVX2
+    static bool has_avx2() {
+        static const bool has = __builtin_cpu_supports("avx2");
+        return has;
+    }
+#endif
+
+    // out[i] = f(a[i], b[i]) for i < n. an operand that is not a vector (va or vb false) is the number at a or b
+    template <class T, class R, class F> inline __attribute__((always_inline))
+    void zip(R *__restrict out, const T *a, bool va, const T *b, bool vb, size_t n, F f) {
+        if (va && vb) {
+            for (size_t i = 0; i < n; i++) out[i] = f(a[i], b[i]);
+        }
+        else if (va) {
+            T y = *b;
+            for (size_t i = 0; i < n; i++) out[i] = f(a[i], y);
+        }
+        else {
+            T x = *a;
+            for (size_t i = 0; i < n; i++) out[i] = f(x, b[i]);
+        }
+    }
+
+    // out = a OP b for OP in + - * /, Ts, or == != < > <= >=, int64_t 1 where true and 0 where false
+    template <class T> inline __attribute__((always_inline))
+    void elementwise(int op, void *out, const T *a, bool va, const T *b, bool vb, size_t n) {
+        T *r = (T *) out;
+        int64_t *m = (int64_t *) out;
+        switch (op) {
+        case node::PLUS: zip(r, a, va, b, vb, n, [](T x, T y) {return x + y;}); break;
+        case node::MINUS: zip(r, a, va, b, vb, n, [](T x, T y) {return x - y;}); break;
+        case node::MUL: zip(r, a, va, b, vb, n, [](T x, T y) {return x * y;}); break;
+        case node::DIV: zip(r, a, va, b, vb, n, [](T x, T y) {return x / y;}); break;
+        case node::EQEQ: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x == y);}); break;
+        case node::NOTEQ: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x != y);}); break;
+        case node::LT: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x < y);}); break;
+        case node::GT: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x > y);}); break;
+        case node::LTE: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x <= y);}); break;
+        default: zip(m, a, va, b, vb, n, [](T x, T y) {return (int64_t) (x >= y);}); break;
+        }
+    }
+
+    // (sum A), (dot A B), (min A) or (max A) of n > 0 ints. they are exact in any order
+    inline __attribute__((always_inline)) int64_t reduce_ints(int op, const int64_t *a, const int64_t *b, size_t n) {
+        int64_t s = op == node::SUM || op == node::DOT ? 0 : a[0];
+        switch (op) {
+        case node::SUM: for (size_t i = 0; i < n; i++) s += a[i]; break;
+        case node::DOT: for (size_t i = 0; i < n; i++) s += a[i] * b[i]; break;
+        case node::MIN: for (size_t i = 0; i < n; i++) s = a[i] < s ? a[i] : s; break;
+        default: for (size_t i = 0; i < n; i++) s = a[i] > s ? a[i] : s; break;
+        }
+        return s;
+    }
+
+    // the reductions of doubles keep 8 partial results, item i going to lane i % 8, which are combined
+    // in one order, so that the result does not depend on the instructions used. the kernels fold the
+    // first n / 8 * 8 items into the lanes and return how many they did
+    static size_t lanes_base(int op, const double *a, const double *b, size_t n, double *lane) {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128d s[4]; // lanes 2k and 2k + 1
+        for (int k = 0; k < 4; k++) s[k] = _mm_loadu_pd(lane + 2 * k);
+        switch (op) {
+        case node::SUM:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 4; k++) s[k] = _mm_add_pd(s[k], _mm_loadu_pd(a + i + 2 * k));}
+            break;
+        case node::DOT:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 4; k++) s[k] = _mm_add_pd(s[k], _mm_mul_pd(_mm_loadu_pd(a + i + 2 * k), _mm_loadu_pd(b + i + 2 * k)));}
+            break;
+        case node::MIN:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 4; k++) s[k] = _mm_min_pd(_mm_loadu_pd(a + i + 2 * k), s[k]);}
+            break;
+        default:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 4; k++) s[k] = _mm_max_pd(_mm_loadu_pd(a + i + 2 * k), s[k]);}
+            break;
+        }
+        for (int k = 0; k < 4; k++) _mm_storeu_pd(lane + 2 * k, s[k]);
+#endif
+        return i;
+    }
+
+    static void sqrt_base(double *out, const double *a, size_t n) {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 2 <= n; i += 2) _mm_storeu_pd(out + i, _mm_sqrt_pd(_mm_loadu_pd(a + i)));
+#endif
+        for (; i < n; i++) out[i] = sqrt(a[i]);
+    }
+
+    static void kernel_base(int op, void *out, const double *a, bool va, const double *b, bool vb, size_t n) {
+        elementwise(op, out, a, va, b, vb, n);
+    }
+
+    static void kernel_base(int op, void *out, const int64_t *a, bool va, const int64_t *b, bool vb, size_t n) {
+        elementwise(op, out, a, va, b, vb, n);
+    }
+
+    static int64_t kernel_base(int op, const int64_t *a, const int64_t *b, size_t n) {
+        return reduce_ints(op, a, b, n);
+    }
+
+#ifdef PAREN_AVX2
+    PAREN_AVX2 static size_t lanes_avx2(int op, const double *a, const double *b, size_t n, double *lane) {
+        size_t i = 0;
+        __m256d s[2]; // lanes 4k to 4k + 3
+        for (int k = 0; k < 2; k++) s[k] = _mm256_loadu_pd(lane + 4 * k);
+        switch (op) {
+        case node::SUM:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 2; k++) s[k] = _mm256_add_pd(s[k], _mm256_loadu_pd(a + i + 4 * k));}
+            break;
+        case node::DOT:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 2; k++) s[k] = _mm256_add_pd(s[k], _mm256_mul_pd(_mm256_loadu_pd(a + i + 4 * k), _mm256_loadu_pd(b + i + 4 * k)));}
+            break;
+        case node::MIN:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 2; k++) s[k] = _mm256_min_pd(_mm256_loadu_pd(a + i + 4 * k), s[k]);}
+            break;
+        default:
+            for (; i + 8 <= n; i += 8) {
+                for (int k = 0; k < 2; k++) s[k] = _mm256_max_pd(_mm256_loadu_pd(a + i + 4 * k), s[k]);}
+            break;
+        }
+        for (int k = 0; k < 2; k++) _mm256_storeu_pd(lane + 4 * k, s[k]);
+        return i;
+    }
+
+    PAREN_AVX2 static void sqrt_avx2(double *out, const double *a, size_t n) {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) _mm256_storeu_pd(out + i, _mm256_sqrt_pd(_mm256_loadu_pd(a + i)));
+        for (; i < n; i++) out[i] = sqrt(a[i]);
+    }
+
+    PAREN_AVX2 static void kernel_avx2(int op, void *out, const double *a, bool va, const double *b, bool vb, size_t n) {
+        elementwise(op, out, a, va, b, vb, n);
+    }
+
+    PAREN_AVX2 static void kernel_avx2(int op, void *out, const int64_t *a, bool va, const int64_t *b, bool vb, size_t n) {
+        elementwise(op, out, a, va, b, vb, n);
+    }
+
+    PAREN_AVX2 static int64_t kernel_avx2(int op, const int64_t *a, const int64_t *b, size_t n) {
+        return reduce_ints(op, a, b, n);
+    }
+#endif
+
+    // the kernel for the CPU this runs on
+    template <class... A> inline auto kernel(A... args) {
+#ifdef PAREN_AVX2
+        if (has_avx2()) return kernel_avx2(args...);
+#endif
+        return kernel_base(args...);
+    }
+
+    inline double lane_op(int op, double s, double x, double y) {
+        switch (op) {
+        case node::SUM: return s + x;
+        case node::DOT: return s + x * y;
+        case node::MIN: return x < s ? x : s;
+        default: return x > s ? x : s;
+        }
+    }
+
+    // (sum A), (dot A B), (min A) or (max A) of n > 0 doubles
+    static double reduce(int op, const double *a, const double *b, size_t n) {
+        double lane[8];
+        for (int k = 0; k < 8; k++) lane[k] = op == node::SUM || op == node::DOT ? 0.0 : a[0];
+        size_t i;
+#ifdef PAREN_AVX2
+        if (has_avx2()) i = lanes_avx2(op, a, b, n, lane); else
+#endif
+        i = lanes_base(op, a, b, n, lane);
+        for (; i < n; i++) lane[i % 8] = lane_op(op, lane[i % 8], a[i], op == node::DOT ? b[i] : 0.0);
+        int combine = op == node::DOT ? node::SUM : op;
+        for (int w = 1; w < 8; w *= 2) {
+            for (int k = 0; k < 8; k += 2 * w) lane[k] = lane_op(combine, lane[k], lane[k + w], 0.0);
+        }
+        return lane[0];
+    }
+
+    inline vec_object *vec_of(const node &n) {
+        return (vec_object *) n.v_obj;
+    }
+
+    static node vec_node(vec_object *v) {
+        heap::current()->account(v->extra());
+        return node(node::T_VEC, v);
+    }
+
+    template <class T> inline T number_as(node x) {
+        return x.type == node::T_INT ? (T) x.v_int : (T) x.to_double();
+    }
+
+    template <> inline int64_t number_as<int64_t>(node x) {
+        return x.type == node::T_INT ? x.v_int : int64_of(x.to_double());
+    }
+
+    // the items of x as Ts: its own if it is a vector of them, else converted into buf. a number is one item
+    template <class T> static const T *items_as(const node &x, vector<T> &buf) {
+        if (x.type != node::T_VEC) {
+            buf.assign(1, number_as<T>(x));
+            return buf.data();
+        }
+        vec_object *v = vec_of(x);
+        if (v->ints) {
+            if (is_same<T, int64_t>::value) return (const T *) v->i64.data();
+            buf.assign(v->i64.begin(), v->i64.end());
+        }
+        else {
+            if (is_same<T, double>::value) return (const T *) v->f64.data();
+            buf.resize(v->f64.size());
+            for (size_t i = 0; i < buf.size(); i++) buf[i] = is_same<T, int64_t>::value ? (T) int64_of(v->f64[i]) : (T) v->f64[i];
+        }
+        return buf.data();
+    }
+
+    // an i64vec (f64vec unless ints) of the n numbers items[0] ..
+    template <class L> static node to_vec(bool ints, const L &items, size_t n) {
+        vec_object *v = new vec_object(ints);
+        if (ints) {
+            v->i64.resize(n);
+            for (size_t i = 0; i < n; i++) v->i64[i] = number_as<int64_t>(items[i]);
+        }
+        else {
+            v->f64.resize(n);
+            for (size_t i = 0; i < n; i++) v->f64[i] = number_as<double>(items[i]);
+        }
+        return vec_node(v);
+    }
+
+    // vector x as an i64vec (f64vec unless ints)
+    static node convert(bool ints, const node &x) {
+        if (vec_of(x)->ints == ints) return x;
+        vec_object *v = new vec_object(ints);
+        if (ints) items_as(x, v->i64); else items_as(x, v->f64); // converted into the vector
+        return vec_node(v);
+    }
+
+    // x as a vector: itself, or the items of a list or seq, that the first of decides between i64 and f64
+    static bool as_vec(paren &p, const node &x, node &v) {
+        if (x.type == node::T_VEC) {
+            v = x;
+            return true;
+        }
+        if (x.type != node::T_LIST && x.type != node::T_SEQ) {
+            *p.err << "Not a vector: " << node(x).str_with_type() << endl;
+            return false;
+        }
+        const list_object &l = x.v_list();
+        v = to_vec(!l.empty() && l[0].type == node::T_INT, l, l.size());
+        return true;
+    }
+
+    template <class T> static node vectorized(int op, const node &a, const node &b, size_t n) {
+        vector<T> buf_a, buf_b;
+        const T *x = items_as(a, buf_a), *y = items_as(b, buf_b);
+        vec_object *r = new vec_object(op >= node::EQEQ || is_same<T, int64_t>::value);
+        if (r->ints) r->i64.resize(n); else r->f64.resize(n);
+        kernel(op, r->ints ? (void *) r->i64.data() : (void *) r->f64.data(), x, a.type == node::T_VEC, y, b.type == node::T_VEC, n);
+        return vec_node(r);
+    }
+
+    // (OP A B) for OP in + - * / == != < > <= >= where A or B is a vector, item by item. a number
+    // goes with every item. the first operand decides between i64 and f64 arithmetic, as with numbers.
+    // comparisons make an i64vec of 1 where true and 0 where false
+    static node vectorized(paren &p, int op, const node &a, const node &b) {
+        size_t n = a.type == node::T_VEC ? vec_of(a)->size() : vec_of(b)->size();
+        if (a.type == node::T_VEC && b.type == node::T_VEC && vec_of(b)->size() != n) {
+            *p.err << "Vectors of different lengths: " << n << " and " << vec_of(b)->size() << endl;
+            return node();
+        }
+        bool ints = a.type == node::T_VEC ? vec_of(a)->ints : a.type == node::T_INT;
+        return ints ? vectorized<int64_t>(op, a, b, n) : vectorized<double>(op, a, b, n);
+    }
+
+    // (sqrt V) item by item
+    static node vec_sqrt(const node &x) {
+        vector<double> buf;
+        const double *a = items_as(x, buf);
+        vec_object *r = new vec_object(false);
+        r->f64.resize(vec_of(x)->size());
+#ifdef PAREN_AVX2
+        if (has_avx2()) sqrt_avx2(r->f64.data(), a, r->f64.size()); else
+#endif
+        sqrt_base(r->f64.data(), a, r->f64.size());
+        return vec_node(r);
+    }
+
+    // (sum V), (dot V W), (min V) or (max V). i64 results are returned as ints, or doubles beyond int. min and max of nothing are nil
+    static node vec_reduce(paren &p, int op, const node &x, const node &y) {
+        node a, b;
+        if (!as_vec(p, x, a) || (op == node::DOT && !as_vec(p, y, b))) return node();
+        size_t n = vec_of(a)->size();
+        if (op == node::DOT && vec_of(b)->size() != n) {
+            *p.err << "Vectors of different lengths: " << n << " and " << vec_of(b)->size() << endl;
+            return node();
+        }
+        bool ints = vec_of(a)->ints;
+        if (n == 0) return op == node::SUM || op == node::DOT ? (ints ? node(0) : node(0.0)) : node();
+        if (ints) {
+            vector<int64_t> buf;
+            return int64_node(kernel(op, vec_of(a)->i64.data(), op == node::DOT ? items_as(b, buf) : NULL, n));
+        }
+        vector<double> buf;
+        return node(reduce(op, vec_of(a)->f64.data(), op == node::DOT ? items_as(b, buf) : NULL, n));
+    }
+
+    inline environment *env_of(const node &f) { // environment of a T_FN
+        return ((fn_object *) f.v_obj)->env;
+    }
+
+    inline bool on_arena(environment *e) { // frames of scopes without closures live on the frame arena
+        return e->sc && !e->sc->captures;
+    }
+
+    node fn(paren &p, const node &n, environment *outer_env) {
+        fn_object *f = new fn_object;
+        f->code = n;
+        if (on_arena(outer_env)) {
+            // captured through a path the resolver cannot see
+            // (e.g. a builtin fn or eval held in a variable). capture a copy
+            environment *copy = heap_frame(p.gc, outer_env->outer, outer_env->sc);
+            for (unsigned int i = 0; i < outer_env->sc->names.size(); i++) copy->slots[i] = outer_env->slots[i];
+            copy->env = outer_env->env;
+            f->env = copy;
+        }
+        else {
+            f->env = outer_env;
+        }
+        return node(node::T_FN, f);
+    }
+
+    static thread_local frame_arena *worker_frames = NULL; // of the pool worker on this thread
+
+    class activation { // the frame of a call to a closure. a tail call replaces it with the frame of the callee
+    private:
+        paren &p;
+        frame_arena &frames; // of this thread
+        frame_arena::mark m;
+        int profiled; // frames pushed on the stack of the profiler
+        PAREN_COLD void unprofile();
+    public:
+        environment *env; // NULL if no call
+        activation(paren &p): p(p), frames(worker_frames ? *worker_frames : p.frames), profiled(0), env(NULL) {}
+        ~activation() {
+            leave();
+            if (profiled > 0) unprofile();
+        }
+        PAREN_COLD void profile_builtin(int b);
+        PAREN_COLD void profile_fn(const node &func, environment &caller); // a tail call replaces the frames
+        void enter(const node &func, const node *args, int argc) { // missing arguments are nil
+            leave();
+            scope *sc = list_of(func.v_list()[1])->sc;
+            environment *outer = env_of(func);
+            if (sc->captures) {
+                env = heap_frame(p.gc, outer, sc);
+            }
+            else {
+                m = frames.save();
+                void *mem = frames.alloc(sizeof(environment) + sc->names.size() * sizeof(node));
+                env = new (mem) environment(outer, sc, (node *) ((environment *) mem + 1));
+            }
+            int alen = func.v_list()[1].v_list().size();
+            for (int i = 0; i < alen && i < argc; i++) env->slots[i] = args[i];
+            if (worker_frames) return; // no collection until the pool is done
+            heap::call c = {env, func.v_obj};
+            p.gc.calls.push_back(c);
+        }
+        void leave() {
+            if (env == NULL) return;
+            if (!worker_frames) p.gc.calls.pop_back();
+            if (on_arena(env)) {
+                env->~environment();
+                frames.restore(m);
+            }
+            env = NULL;
+        }
+    };
+
+    // counts the calls of each builtin and fn while profiling, with the time spent in them and in them
+    // alone, and samples the stack of calls every interval. a sample is taken when a call starts or ends
+    // after the interval has passed, weighted by the intervals passed, so the clock is read only there.
+    // a builtin is on the stack while its arguments are evaluated; a tail call replaces the fn that makes
+    // it and the builtins it was made from
+    class profiler {
+    public:
+        struct entry {
+            size_t calls;
+            int64_t inclusive, exclusive; // ns
+            int active; // frames on the stack. time is counted inclusive for the outermost
+        };
+        struct frame {
+            int id;
+            int64_t start, children; // ns
+        };
+        paren &p;
+        int64_t interval, next_sample; // ns
+        vector<entry> entries; // of each id: the builtins, then fns in the order first called
+        vector<string> names; // of each id
+        unordered_map<list_object *, int> fn_ids; // code of a fn => its id, shared by its closures
+        vector<node> codes; // of the fns with ids, kept from collection while profiling
+        vector<frame> stack;
+        map<vector<int>, size_t> samples; // stack of ids => samples
+
+        profiler(paren &p, int sample_us): p(p), interval(max(sample_us, 1) * 1000LL), entries(node::PLUS_II), names(node::PLUS_II) {
+            next_sample = now() + interval;
+            for (auto iter = p.builtin_map.begin(); iter != p.builtin_map.end(); iter++) {
+                if (names[iter->second].empty() || iter->first < names[iter->second]) names[iter->second] = iter->first;
+            }
+            p.gc.roots.push_back(&codes);
+        }
+        ~profiler() {
+            stop();
+        }
+        void stop() {
+            auto iter = find(p.gc.roots.begin(), p.gc.roots.end(), &codes);
+            if (iter != p.gc.roots.end()) p.gc.roots.erase(iter);
+        }
+        static int64_t now() {
+            return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        void tick(int64_t t) {
+            if (t < next_sample) return;
+            int64_t n = (t - next_sample) / interval + 1;
+            next_sample += n * interval;
+            if (stack.empty()) return; // between evaluations
+            vector<int> ids(stack.size());
+            for (size_t i = 0; i < stack.size(); i++) ids[i] = stack[i].id;
+            samples[ids] += n;
+        }
+        void enter(int id) {
+            int64_t t = now();
+            tick(t);
+            entries[id].calls++;
+            entries[id].active++;
+            frame f = {id, t, 0};
+            stack.push_back(f);
+        }
+        void leave() {
+            int64_t t = now();
+            tick(t);
+            frame f = stack.back();
+            stack.pop_back();
+            int64_t spent = t - f.start;
+            entry &e = entries[f.id];
+            e.exclusive += spent - f.children;
+            if (--e.active == 0) e.inclusive += spent;
+            if (!stack.empty()) stack.back().children += spent;
+        }
+        // the id of fn func called from env, named by the innermost variable that holds a closure of it
+        int fn_id(const node &func, environment &env) {
+            list_object *code = &func.v_list();
+            auto iter = fn_ids.find(code);
+            if (iter != fn_ids.end()) return iter->second;
+            string name;
+            auto holds = [&](const node &v) {return v.type == node::T_FN && &v.v_list() == code;};
+            for (environment *e = &env; e != NULL && name.empty(); e = e->outer) {
+                for (size_t i = 0; e->sc != NULL && i < e->sc->names.size() && name.empty(); i++) {
+                    if (holds(e->slots[i])) name = p.symbols.names[e->sc->names[i]];
+                }
+                for (auto v = e->env.begin(); v != e->env.end() && name.empty(); v++) {
+                    if (holds(v->second)) name = p.symbols.names[v->first];
+                }
+            }
+            if (name.empty()) name = "fn" + func.v_list()[1].to_str(); // anonymous: by its arguments
+            int id = entries.size();
+            fn_ids[code] = id;
+            codes.push_back(node(node::T_LIST, code));
+            entries.push_back(entry());
+            names.push_back(name);
+            return id;
+        }
+    };
+
+    void activation::unprofile() {
+        for (; profiled > 0; profiled--) p.profiling->leave();
+    }
+
+    void activation::profile_builtin(int b) {
+        p.profiling->enter(generic(b));
+        profiled++;
+    }
+
+    void activation::profile_fn(const node &func, environment &caller) {
+        unprofile();
+        p.profiling->enter(p.profiling->fn_id(func, caller));
+        profiled = 1;
+    }
+
+    void paren::profile_start(int sample_us) {
+        prof.reset(new profiler(*this, sample_us));
+        profiling = prof.get();
+    }
+
+    void paren::profile_stop() {
+        if (profiling != NULL) profiling->stop();
+        profiling = NULL;
+    }
+
+    void paren::profile_report(ostream &o) {
+        if (!prof) return;
+        vector<int> ids;
+        for (size_t i = 0; i < prof->entries.size(); i++) {
+            if (prof->entries[i].calls > 0) ids.push_back(i);
+        }
+        sort(ids.begin(), ids.end(), [&](int a, int b) {return prof->entries[a].exclusive > prof->entries[b].exclusive;});
+        char line[64];
+        o << "       calls     incl ms     excl ms  name" << endl;
+        for (size_t i = 0; i < ids.size(); i++) {
+            const profiler::entry &e = prof->entries[ids[i]];
+            snprintf(line, sizeof(line), "%12zu %11.3f %11.3f  ", e.calls, e.inclusive / 1e6, e.exclusive / 1e6);
+            o << line << prof->names[ids[i]] << endl;
+        }
+    }
+
+    void paren::profile_stacks(ostream &o) {
+        if (!prof) return;
+        for (auto iter = prof->samples.begin(); iter != prof->samples.end(); iter++) {
+            for (size_t i = 0; i < iter->first.size(); i++) {
+                if (i > 0) o << ';';
+                o << prof->names[iter->first[i]];
+            }
+            o << ' ' << iter->second << '\n';
+        }
+    }
+
+    // work-stealing thread pool. each thread has a deque of jobs: it takes the newest of its own, and
+    // when that is empty steals the oldest of another's. a thread waiting for its jobs runs jobs
+    // meanwhile, so parallel builtins can nest
+    class thread_pool {
+    public:
+        thread_pool(paren &p, int threads);
+        ~thread_pool();
+        int size() const {return queues.size();}
+        void run(int n, const function<void(int)> &task); // task(0) .. task(n - 1), returns when all are done
+    private:
+        struct batch {
+            const function<void(int)> *task;
+            atomic<int> left; // jobs not finished
+            exception_ptr error; // the first thrown
+            mutex m;
+        };
+        struct job {
+            batch *b;
+            int i;
+        };
+        struct queue {
+            mutex m;
+            deque<job> jobs;
+        };
+        paren &p;
+        vector<queue *> queues; // queues[0] is for threads outside the pool
+        vector<thread> workers;
+        mutex m;
+        condition_variable wake;
+        atomic<int> queued; // jobs in all queues
+        bool stop;
+        bool take(int self, job &j);
+        void execute(const job &j);
+        void work(int self);
+        thread_pool(const thread_pool &);
+        thread_pool &operator=(const thread_pool &);
+    };
+
+    static thread_local int pool_queue = 0; // index of the queue of this thread in its pool
+
+    thread_pool::thread_pool(paren &p, int threads): p(p), queued(0), stop(false) {
+        for (int i = 0; i < max(threads, 1); i++) queues.push_back(new queue);
+        for (int i = 1; i < max(threads, 1); i++) workers.push_back(thread(&thread_pool::work, this, i));
+    }
+
+    thread_pool::~thread_pool() {
+        {
+            lock_guard<mutex> l(m);
+            stop = true;
+        }
+        wake.notify_all();
+        for (unsigned int i = 0; i < workers.size(); i++) workers[i].join();
+        for (unsigned int i = 0; i < queues.size(); i++) delete queues[i];
+    }
+
+    bool thread_pool::take(int self, job &j) {
+        int n = queues.size();
+        for (int k = 0; k < n; k++) {
+            queue &q = *queues[(self + k) % n];
+            lock_guard<mutex> l(q.m);
+            if (q.jobs.empty()) continue;
+            if (k == 0) {
+                j = q.jobs.back();
+                q.jobs.pop_back();
+            }
+            else {
+                j = q.jobs.front();
+                q.jobs.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void thread_pool::execute(const job &j) {
+        batch &b = *j.b;
+        try {
+            (*b.task)(j.i);
+        }
+        catch (...) {
+            lock_guard<mutex> l(b.m);
+            if (!b.error) b.error = current_exception();
+        }
+        b.left--; // b may be gone after this
+    }
+
+    void thread_pool::work(int self) {
+        frame_arena frames;
+        heap::current() = &p.gc;
+        heap::worker() = true;
+        worker_frames = &frames;
+        pool_queue = self;
+        while (true) {
+            job j;
+            if (take(self, j)) {
+                execute(j);
+                continue;
+            }
+            unique_lock<mutex> l(m);
+            wake.wait(l, [this] {return stop || queued > 0;});
+            if (stop) return;
+        }
+    }
+
+    void thread_pool::run(int n, const function<void(int)> &task) {
+        batch b;
+        b.task = &task;
+        b.left = n;
+        {
+            queue &q = *queues[pool_queue];
+            lock_guard<mutex> l(q.m);
+            for (int i = n; i-- > 0;) { // task(0) is taken first
+                job j = {&b, i};
+                q.jobs.push_back(j);
+            }
+            queued += n;
+        }
+        {
+            lock_guard<mutex> l(m);
+        }
+        wake.notify_all();
+        while (b.left > 0) {
+            job j;
+            if (take(pool_queue, j)) execute(j);
+            else this_thread::yield();
+        }
+        if (b.error) rethrow_exception(b.error);
+    }
+
+    class parallel_region { // the heap of p is shared with the pool while in scope
+    private:
+        heap &h;
+        bool outer; // if entered by a thread outside the pool
+    public:
+        parallel_region(heap &h): h(h), outer(!heap::worker()) {if (outer) h.shared++;}
+        ~parallel_region() {if (outer) h.shared--;}
+    };
+
+    // body(from, to) over consecutive ranges that cover [0, n), run in parallel on the pool of p
+    static void parallel_for(paren &p, size_t n, const function<void(size_t, size_t)> &body) {
+        if (p.threads <= 1 || n <= 1) {
+            body(0, n);
+            return;
+        }
+        if (!p.pool) p.pool.reset(new thread_pool(p, p.threads));
+        int chunks = (int) min(n, (size_t) p.pool->size() * 8); // several per thread, to balance uneven work
+        parallel_region region(p.gc);
+        p.pool->run(chunks, [&](int c) {body(n * c / chunks, n * (c + 1) / chunks);});
+    }
+
+    class resolver { // rewrites the variable references in fn bodies into lexical addresses
+    private:
+        paren &p;
+        vector<scope *> scopes; // enclosing fn scopes, innermost first
+
+        int builtin_of(node &head) {
+            if (head.type == node::T_BUILTIN) return generic(head.v_int);
+            if (head.type != node::T_SYMBOL) return -1;
+            return head.v_int < (int) p.builtin_ids.size() ? p.builtin_ids[head.v_int] : -1;
+        }
+        void add(scope &sc, node &sym) {
+            if (sym.type != node::T_SYMBOL) return;
+            for (unsigned int i = 0; i < sc.names.size(); i++) {
+                if (sc.names[i] == sym.v_int) return;
+            }
+            sc.names.push_back(sym.v_int);
+        }
+        void collect(node &n, scope &sc) { // symbols assigned by set or for, outside nested fns
+            if (n.type == node::T_SYMBOL || n.type == node::T_BUILTIN) {
+                int b = builtin_of(n);
+                if (b == node::FN || b == node::EVAL) sc.captures = true; // closures may be made over the frame
+                return;
+            }
+            if (n.type != node::T_LIST || n.v_list().empty()) return;
+            list_object &v = n.v_list();
+            switch (builtin_of(v[0])) {
+            case node::QUOTE:
+                return;
+            case node::FN:
+                sc.captures = true;
+                return;
+            case node::SET:
+            case node::FOR:
+                if (v.size() >= 2) add(sc, v[1]);
+                break;
+            }
+            for (unsigned int i = 0; i < v.size(); i++) collect(v[i], sc);
+        }
+        void rewrite(node &n) {
+            if (n.type == node::T_SYMBOL) {
+                for (unsigned int depth = 0; depth < scopes.size(); depth++) {
+                    vector<int> &names = scopes[depth]->names;
+                    for (unsigned int slot = 0; slot < names.size(); slot++) {
+                        if (names[slot] == n.v_int) {
+                            n.type = node::T_LOCAL;
+                            n.v_addr.depth = depth;
+                            n.v_addr.slot = slot;
+                            return;
+                        }
+                    }
+                }
+                return;
+            }
+            if (n.type != node::T_LIST || n.v_list().empty()) return;
+            list_object &v = n.v_list();
+            switch (builtin_of(v[0])) {
+            case node::QUOTE:
+                return;
+            case node::FN:
+                fn_form(n);
+                return;
+            }
+            for (unsigned int i = 0; i < v.size(); i++) rewrite(v[i]);
+        }
+    public:
+        resolver(paren &p, environment &env): p(p) {
+            for (environment *e = &env; e != NULL; e = e->outer) {
+                if (e->sc) scopes.push_back(e->sc);
+            }
+        }
+
+        void fn_form(node &n) { // (fn (ARGUMENT ..) BODY ..)
+            list_object &v = n.v_list();
+            if (v.size() < 2 || v[1].type != node::T_LIST || list_of(v[1])->sc) return; // malformed or already resolved
+            scope *sc = new scope;
+            for (unsigned int i = 0; i < v[1].v_list().size(); i++) {
+                sc->names.push_back(v[1].v_list()[i].v_int);
+            }
+            for (unsigned int i = 2; i < v.size(); i++) collect(v[i], *sc);
+            list_of(v[1])->sc = sc;
+            scopes.insert(scopes.begin(), sc);
+            for (unsigned int i = 2; i < v.size(); i++) rewrite(v[i]);
+            scopes.erase(scopes.begin());
+        }
+    };
+
+    static const size_t OUT_BUFFER = 64 << 10;
+
+    // appends sep and the text of x to the output of p, also when pool threads print at once
+    static void print(paren &p, const char *sep, const node &x) {
+        unique_lock<mutex> l(p.lock, defer_lock);
+        if (p.gc.shared) l.lock();
+        p.out_buffer += sep;
+        format(x, p.out_buffer);
+    }
+
+    // the end of a pr, or of a prn if line: writes the output out if the flush policy says so
+    static void end_print(paren &p, bool line) {
+        unique_lock<mutex> l(p.lock, defer_lock);
+        if (p.gc.shared) l.lock();
+        if (line) p.out_buffer += '\n';
+        switch (p.flush_policy) {
+        case paren::FLUSH_EACH: p.flush(); break;
+        case paren::FLUSH_LINE:
+            if (line || memchr(p.out_buffer.data(), '\n', p.out_buffer.size()) != NULL) p.flush();
+            break;
+        default:
+            if (p.out_buffer.size() >= OUT_BUFFER) p.flush();
+            break;
+        }
+    }
+
+    // the value of n, borrowed from its variable if n is one (valid until the variable is set), else held in tmp
+    inline const node &paren::eval_ref(node &n, environment &env, node &tmp) {
+        if (n.type <= node::T_BOOL) return n; // a literal
+        if (n.type == node::T_LOCAL || n.type == node::T_SYMBOL) {
+            node *v = variable(n, env);
+            if (v != NULL && v->type != node::T_NIL) return *v;
+        }
+        return tmp = eval(n, env);
+    }
+
+    // (OP A B) for OP in + - * / == != < > <= >=. the first operand decides between int and double arithmetic
+    inline node binary(paren &p, int op, node a, node b) {
+        if (a.type == node::T_VEC || b.type == node::T_VEC) return vectorized(p, op, a, b);
+        if (a.type == node::T_INT) {
+            int x = a.v_int, y = b.to_int();
+            switch (op) {
+            case node::PLUS: return node(x + y);
+            case node::MINUS: return node(x - y);
+            case node::MUL: return node(x * y);
+            case node::DIV: return node(x / y);
+            case node::EQEQ: return node(x == y);
+            case node::NOTEQ: return node(x != y);
+            case node::LT: return node(x < y);
+            case node::GT: return node(x > y);
+            case node::LTE: return node(x <= y);
+            default: return node(x >= y);
+            }
+        }
+        double x = a.v_double, y = b.to_double();
+        switch (op) {
+        case node::PLUS: return node(x + y);
+        case node::MINUS: return node(x - y);
+        case node::MUL: return node(x * y);
+        case node::DIV: return node(x / y);
+        case node::EQEQ: return node(x == y);
+        case node::NOTEQ: return node(x != y);
+        case node::LT: return node(x < y);
+        case node::GT: return node(x > y);
+        case node::LTE: return node(x <= y);
+        default: return node(x >= y);
+        }
+    }
+
+    // rewrites the head of call n into builtin b, unless other threads may be reading the code
+    inline void requicken(paren &p, node &n, int b) {
+        if (p.gc.shared) return;
+        n.v_list()[0] = builtin(b);
+        if (b == generic(b)) p.stats.deoptimized++; else p.stats.specialized++;
+    }
+
+    // the value of (OP A B) at call n, that is quickened if A and B are both ints or both doubles
+    inline node specialize(paren &p, node &n, int op, const node &a, const node &b) {
+        if (a.type == b.type && (a.type == node::T_INT || a.type == node::T_DOUBLE)) {
+            int i = find(quickened, quickened + QUICKENED, op) - quickened;
+            requicken(p, n, (a.type == node::T_INT ? node::PLUS_II : node::PLUS_DD) + i);
+        }
+        return binary(p, op, a, b);
+    }
+
+    node paren::callee(node &n, environment &env) {
+        node &head = n.v_list()[0];
+        if (head.type == node::T_BUILTIN) return head;
+        if (head.type != node::T_SYMBOL || gc.shared) return eval(head, env);
+        list_object *site = list_of(n);
+        call_site &c = call_cache[((uintptr_t) site >> 4) & (call_cache.size() - 1)];
+        if (c.site == site && c.sc == env.sc && c.collections == gc.stats.collections
+            && c.version == environment::version && c.slot->type == node::T_FN) {
+            stats.cached_calls++;
+            return *c.slot;
+        }
+        stats.uncached_calls++;
+        node *v = env.find(head.v_int);
+        if (v == NULL || v->type == node::T_NIL) return eval(head, env); // a builtin, or unknown
+        if (v->type == node::T_FN && v == global_env.find(head.v_int)) {
+            // cacheable if no scope around the call has the name, whose variable could be set later
+            bool local = false;
+            for (environment *e = &env; e != NULL && !local; e = e->outer) {
+                if (e->sc) local = std::find(e->sc->names.begin(), e->sc->names.end(), head.v_int) != e->sc->names.end();
+            }
+            if (!local) {
+                c.site = site;
+                c.sc = env.sc;
+                c.slot = v;
+                c.collections = gc.stats.collections;
+                c.version = environment::version;
+            }
+        }
+        return *v;
+    }
+
+    node paren::call(const node &func, const node *args, int argc, environment &env) {
+        if (func.type == node::T_FN) {
+            list_object &f = func.v_list();
+            activation frame(*this);
+            if (profiling != NULL && !heap::worker()) frame.profile_fn(func, env);
+            frame.enter(func, args, argc);
+            int flen = f.size();
+            for (int i = 2; i < flen - 1; i++) { // body
+                eval(f.at(i), *frame.env);
+            }
+            return eval(f.at(flen - 1), *frame.env);
+        }
+        // a builtin: evaluate (FUNC ARGUMENT ..), quoting the values that are not self-evaluating
+        vector<node> expr;
+        gc_root root(gc, expr);
+        expr.push_back(func);
+        for (int i = 0; i < argc; i++) {
+            const node &a = args[i];
+            if (a.type == node::T_LIST || a.type == node::T_SYMBOL || a.type == node::T_LOCAL) {
+                vector<node> q;
+                q.push_back(builtin(node::QUOTE));
+                q.push_back(a);
+                expr.push_back(node(std::move(q)));
+            }
+            else {
+                expr.push_back(a);
+            }
+        }
+        node n2(std::move(expr));
+        return eval(n2, env);
+    }
+
+    // machine code for hot loops of numbers. a for or while form that has run HOT_LOOP iterations is
+    // compiled if all it does is arithmetic, comparisons and logic, set, ++, --, if, when, begin, for and
+    // while on ints, doubles and bools. the code works on a block of slots that the variables it uses are
+    // copied into before it runs and back after it. it is specialized for the types the variables had
+    // when it was compiled: entered with other types, the form is rewritten back for eval
+    static const int HOT_LOOP = 1000; // iterations before a loop is compiled
+    static const int COLD_LOOP = -16 * HOT_LOOP; // where counting restarts after compiling failed
+    static const int LOOP_SLOTS = 64; // variables and bounds of a compiled loop
+
+    struct native_loop {
+        void (*code)(node *slots);
+        size_t size; // of the mapping of code
+        vector<node> vars; // symbol of each slot that is a variable, nil for the bounds of a for
+        vector<int> types; // of each variable when the loop is entered
+        vector<bool> assigned; // if the loop sets the variable, that is then its binding in the environment
+        vector<bool> updated; // if the loop changes it with ++ or --
+        vector<bool> read_first; // if the loop may read it before setting it. if not, it may also be nil on entry
+        int last, step; // slots of the bounds of the form, if a for
+        native_loop(): code(NULL), size(0), last(-1), step(-1) {}
+    };
+
+    class native_code {
+    public:
+        struct heat {
+            list_object *site; // a for or while form
+            int count; // of its iterations
+        };
+        vector<native_loop *> loops; // by (builtin - node::NATIVE) / 2
+        vector<heat> heats; // direct-mapped by the address of the form
+
+        native_code(): heats(256) {}
+        ~native_code() {
+            for (native_loop *l : loops) {
+#ifdef PAREN_NATIVE
+                munmap((void *) l->code, l->size);
+#endif
+                delete l;
+            }
+        }
+        int &count(node &n) {
+            list_object *site = list_of(n);
+            heat &h = heats[((uintptr_t) site >> 4) & (heats.size() - 1)];
+            if (h.site != site) {
+                h.site = site;
+                h.count = 0;
+            }
+            return h.count;
+        }
+    };
+
+    // the iteration counter of loop n, or cold if it is not to be compiled
+    inline int &loop_heat(paren &p, node &n, int &cold) {
+        if (!p.jit || p.gc.shared) return cold;
+        if (!p.native) p.native.reset(new native_code);
+        return p.native->count(n);
+    }
+
+#ifdef PAREN_NATIVE
+    class loop_compiler { // x86-64 code of a loop form, for the types of the variables in env
+    private:
+        enum {EAX = 0, ECX = 1, EDX = 2}; // also XMM0, XMM1, XMM2
+        static const int TAG = offsetof(node, type), VALUE = offsetof(node, v_int);
+        paren &p;
+        environment &env;
+        native_loop &loop;
+        vector<unsigned char> code;
+        vector<int> types; // of each slot: its type when entered, or else the type it is first set to
+        vector<bool> written; // if the code has set the slot on every path to this point
+        bool ok;
+
+        void op(initializer_list<int> bytes) {
+            for (int b : bytes) code.push_back((unsigned char) b);
+        }
+        void imm32(int x) {
+            for (int i = 0; i < 4; i++) code.push_back((unsigned char) ((unsigned int) x >> (8 * i)));
+        }
+        void imm64(uint64_t x) {
+            for (int i = 0; i < 8; i++) code.push_back((unsigned char) (x >> (8 * i)));
+        }
+        void mem(initializer_list<int> opcode, int reg, int slot, int offset = VALUE) { // OPCODE reg, [rbx + slot]
+            op(opcode);
+            code.push_back((unsigned char) (0x80 | reg << 3 | 3));
+            imm32(slot * (int) sizeof(node) + offset);
+        }
+        int jump(initializer_list<int> opcode) { // with a rel32 to patch
+            op(opcode);
+            imm32(0);
+            return code.size() - 4;
+        }
+        void patch(int at, int target) {
+            int rel = target - (at + 4);
+            memcpy(&code[at], &rel, 4);
+        }
+        void patch(int at) {patch(at, code.size());}
+        void double_imm(double x, int xmm) { // movq xmm, x through rax
+            uint64_t bits;
+            memcpy(&bits, &x, 8);
+            op({0x48, 0xB8});
+            imm64(bits);
+            op({0x66, 0x48, 0x0F, 0x6E, 0xC0 | xmm << 3});
+        }
+
+        static bool same(const node &a, const node &b) {
+            if (a.type != b.type) return false;
+            if (a.type == node::T_SYMBOL) return a.v_int == b.v_int;
+            return a.v_addr.depth == b.v_addr.depth && a.v_addr.slot == b.v_addr.slot;
+        }
+        int var(node &sym) { // slot of a variable
+            for (size_t k = 0; k < loop.vars.size(); k++) {
+                if (loop.vars[k].type != node::T_NIL && same(loop.vars[k], sym)) return k;
+            }
+            node *v = variable(sym, env);
+            int t = v == NULL ? node::T_NIL : v->type;
+            if (t != node::T_NIL && t != node::T_INT && t != node::T_DOUBLE && t != node::T_BOOL) ok = false;
+            return add(sym, t);
+        }
+        int hidden() { // slot of a value only the code uses
+            return add(node(), node::T_NIL);
+        }
+        int add(const node &sym, int t) {
+            if (loop.vars.size() >= (size_t) LOOP_SLOTS) ok = false;
+            loop.vars.push_back(sym);
+            loop.types.push_back(t);
+            loop.assigned.push_back(false);
+            loop.updated.push_back(false);
+            types.push_back(t);
+            loop.read_first.push_back(false);
+            written.push_back(sym.type == node::T_NIL);
+            return loop.vars.size() - 1;
+        }
+        int builtin_of(node &head) { // builtin called by head, or -1
+            if (head.type == node::T_BUILTIN) return generic(head.v_int);
+            if (head.type != node::T_SYMBOL) return -1;
+            node *v = variable(head, env);
+            if (v != NULL && v->type != node::T_NIL) return -1;
+            return head.v_int < (int) p.builtin_ids.size() ? p.builtin_ids[head.v_int] : -1;
+        }
+        static bool number(int t) {return t == node::T_INT || t == node::T_DOUBLE;}
+
+        void push(int t) {
+            if (t == node::T_DOUBLE) op({0x48, 0x83, 0xEC, 0x08, 0xF2, 0x0F, 0x11, 0x04, 0x24}); // sub rsp, 8; movsd [rsp], xmm0
+            else op({0x50}); // push rax
+        }
+        void pop(int t) {
+            if (t == node::T_DOUBLE) op({0xF2, 0x0F, 0x10, 0x04, 0x24, 0x48, 0x83, 0xC4, 0x08});
+            else op({0x58});
+        }
+        void convert(int from, int to) { // the value in eax or xmm0
+            if (from == node::T_NIL) ok = false;
+            if (from == to) return;
+            if (to == node::T_INT) {
+                if (from == node::T_DOUBLE) op({0xF2, 0x0F, 0x2C, 0xC0}); // cvttsd2si eax, xmm0
+            }
+            else {
+                op({0xF2, 0x0F, 0x2A, 0xC0}); // cvtsi2sd xmm0, eax
+            }
+        }
+        void load(int k, int t) {
+            if (t == node::T_INT) mem({0x8B}, EAX, k);
+            else if (t == node::T_DOUBLE) mem({0xF2, 0x0F, 0x10}, EAX, k);
+            else mem({0x0F, 0xB6}, EAX, k); // movzx
+        }
+        void store(int k, int t) {
+            if (t == node::T_DOUBLE) mem({0xF2, 0x0F, 0x11}, EAX, k);
+            else mem({0x89}, EAX, k);
+            mem({0xC7}, 0, k, TAG);
+            imm32(t);
+        }
+        void operand(node &n, int t) { // n converted to t in ecx or xmm1, keeping eax and xmm0
+            if (n.type == node::T_INT || n.type == node::T_DOUBLE || n.type == node::T_BOOL) {
+                node c = n;
+                if (t == node::T_INT) {
+                    op({0xB9});
+                    imm32(c.to_int());
+                }
+                else {
+                    double_imm(c.to_double(), 1);
+                }
+                return;
+            }
+            if (n.type == node::T_SYMBOL || n.type == node::T_LOCAL) {
+                int k = var(n);
+                read(k);
+                int from = types[k];
+                if (t == node::T_INT) {
+                    if (from == node::T_INT) mem({0x8B}, ECX, k);
+                    else if (from == node::T_DOUBLE) mem({0xF2, 0x0F, 0x2C}, ECX, k); // cvttsd2si
+                    else mem({0x0F, 0xB6}, ECX, k);
+                }
+                else {
+                    if (from == node::T_DOUBLE) mem({0xF2, 0x0F, 0x10}, ECX, k);
+                    else if (from == node::T_INT) mem({0xF2, 0x0F, 0x2A}, ECX, k); // cvtsi2sd
+                    else {
+                        mem({0x0F, 0xB6}, ECX, k);
+                        op({0xF2, 0x0F, 0x2A, 0xC9});
+                    }
+                }
+                return;
+            }
+            push(t);
+            convert(value(n), t);
+            if (t == node::T_INT) op({0x89, 0xC1}); // mov ecx, eax
+            else op({0x66, 0x0F, 0x28, 0xC8}); // movapd xmm1, xmm0
+            pop(t);
+        }
+
+        int arith(int b, list_object &v) { // (+ X ..) and the like
+            size_t len = v.size();
+            if (len <= 1) {
+                op({0xB8});
+                imm32(b == node::PLUS || b == node::MINUS ? 0 : 1);
+                return node::T_INT;
+            }
+            int t = value(v[1]);
+            if (!number(t)) ok = false;
+            for (size_t i = 2; i < len; i++) {
+                operand(v[i], t);
+                if (t == node::T_INT) {
+                    switch (b) {
+                    case node::PLUS: op({0x01, 0xC8}); break;
+                    case node::MINUS: op({0x29, 0xC8}); break;
+                    case node::MUL: op({0x0F, 0xAF, 0xC1}); break;
+                    default: op({0x99, 0xF7, 0xF9}); break; // cdq; idiv ecx
+                    }
+                }
+                else {
+                    switch (b) {
+                    case node::PLUS: op({0xF2, 0x0F, 0x58, 0xC1}); break;
+                    case node::MINUS: op({0xF2, 0x0F, 0x5C, 0xC1}); break;
+                    case node::MUL: op({0xF2, 0x0F, 0x59, 0xC1}); break;
+                    default: op({0xF2, 0x0F, 0x5E, 0xC1}); break;
+                    }
+                }
+            }
+            return t;
+        }
+        int compare(int b, list_object &v) { // (< X Y) and the like
+            if (v.size() != 3) {ok = false; return node::T_NIL;}
+            int t = value(v[1]);
+            if (!number(t)) ok = false;
+            operand(v[2], t);
+            if (t == node::T_INT) {
+                op({0x39, 0xC8}); // cmp eax, ecx
+                int cc;
+                switch (b) {
+                case node::LT: cc = 0x9C; break;
+                case node::GT: cc = 0x9F; break;
+                case node::LTE: cc = 0x9E; break;
+                case node::GTE: cc = 0x9D; break;
+                case node::EQEQ: cc = 0x94; break;
+                default: cc = 0x95; break;
+                }
+                op({0x0F, cc, 0xC0});
+            }
+            else { // false if unordered, but for !=
+                switch (b) {
+                case node::LT: op({0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x97, 0xC0}); break; // ucomisd xmm1, xmm0; seta al
+                case node::GT: op({0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x97, 0xC0}); break;
+                case node::LTE: op({0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x93, 0xC0}); break; // setae
+                case node::GTE: op({0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x93, 0xC0}); break;
+                case node::EQEQ: op({0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8}); break; // sete; setnp; and
+                default: op({0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8}); break; // setne; setp; or
+                }
+            }
+            op({0x0F, 0xB6, 0xC0}); // movzx eax, al
+            return node::T_BOOL;
+        }
+        int logic(int b, list_object &v) { // (&& X ..) and (|| X ..), short-circuit
+            bool is_and = b == node::ANDAND;
+            vector<int> out;
+            for (size_t i = 1; i < v.size(); i++) {
+                if (value(v[i]) != node::T_BOOL) ok = false;
+                op({0x85, 0xC0}); // test eax, eax
+                out.push_back(jump({0x0F, is_and ? 0x84 : 0x85}));
+            }
+            op({0xB8});
+            imm32(is_and);
+            int end = jump({0xE9});
+            for (int at : out) patch(at);
+            op({0xB8});
+            imm32(!is_and);
+            patch(end);
+            return node::T_BOOL;
+        }
+        void assign(node &sym, int t) { // the value in eax or xmm0 to variable sym
+            if (sym.type != node::T_SYMBOL && sym.type != node::T_LOCAL) {ok = false; return;}
+            if (sym.type == node::T_SYMBOL && &env != &p.global_env) ok = false; // defined in the frame
+            if (t != node::T_INT && t != node::T_DOUBLE && t != node::T_BOOL) ok = false;
+            int k = var(sym);
+            if (types[k] == node::T_NIL) types[k] = t;
+            if (types[k] != t) ok = false;
+            loop.assigned[k] = true;
+            written[k] = true;
+            store(k, t);
+        }
+        void loop_for(int k, int t, int last, int step, list_object &v) { // the iterations of (for ..) from var k
+            int top = code.size();
+            int down, in, out, out2;
+            if (t == node::T_INT) {
+                mem({0x8B}, ECX, step);
+                op({0x85, 0xC9}); // test ecx, ecx
+                down = jump({0x0F, 0x88}); // js
+                mem({0x8B}, EAX, k);
+                mem({0x3B}, EAX, last); // cmp eax, [last]
+                out = jump({0x0F, 0x8F}); // jg
+                in = jump({0xE9});
+                patch(down);
+                mem({0x8B}, EAX, k);
+                mem({0x3B}, EAX, last);
+                out2 = jump({0x0F, 0x8C}); // jl
+            }
+            else {
+                mem({0xF2, 0x0F, 0x10}, ECX, step);
+                op({0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xCA}); // xorpd xmm2, xmm2; ucomisd xmm1, xmm2
+                down = jump({0x0F, 0x82}); // jb: step < 0, or NaN
+                mem({0xF2, 0x0F, 0x10}, EAX, k);
+                mem({0xF2, 0x0F, 0x10}, ECX, last);
+                op({0x66, 0x0F, 0x2E, 0xC8}); // ucomisd xmm1, xmm0
+                out = jump({0x0F, 0x82}); // last < a, or NaN
+                in = jump({0xE9});
+                patch(down);
+                mem({0xF2, 0x0F, 0x10}, EAX, k);
+                mem({0x66, 0x0F, 0x2E}, EAX, last); // ucomisd xmm0, [last]
+                out2 = jump({0x0F, 0x82});
+            }
+            patch(in);
+            statements(v, 5);
+            if (t == node::T_INT) {
+                mem({0x8B}, EAX, k);
+                mem({0x03}, EAX, step); // add eax, [step]
+                mem({0x89}, EAX, k);
+            }
+            else {
+                mem({0xF2, 0x0F, 0x10}, EAX, k);
+                mem({0xF2, 0x0F, 0x58}, EAX, step); // addsd xmm0, [step]
+                mem({0xF2, 0x0F, 0x11}, EAX, k);
+            }
+            patch(jump({0xE9}), top);
+            patch(out);
+            patch(out2);
+        }
+        void loop_while(list_object &v) {
+            int top = code.size();
+            if (value(v[1]) != node::T_BOOL) ok = false;
+            op({0x85, 0xC0});
+            int out = jump({0x0F, 0x84});
+            statements(v, 2);
+            patch(jump({0xE9}), top);
+            patch(out);
+        }
+        void statements(list_object &v, size_t from) { // whose values are not used
+            vector<bool> saved = written;
+            for (size_t i = from; i < v.size(); i++) value(v[i]);
+            restore(saved);
+        }
+        void restore(const vector<bool> &saved) { // what is written where a branch may not have run
+            for (size_t k = 0; k < saved.size(); k++) written[k] = saved[k];
+        }
+        void read(int k) {
+            if (written[k]) return;
+            if (loop.types[k] == node::T_NIL) ok = false; // no value yet
+            loop.read_first[k] = true;
+        }
+
+        int value(node &n) { // code leaving the value of n in eax (int, bool) or xmm0 (double). its type
+            if (!ok) return node::T_NIL;
+            switch (n.type) {
+            case node::T_NIL:
+                return node::T_NIL;
+            case node::T_INT: case node::T_BOOL:
+                op({0xB8});
+                imm32(n.type == node::T_INT ? n.v_int : (int) n.v_bool);
+                return n.type;
+            case node::T_DOUBLE:
+                double_imm(n.v_double, 0);
+                return node::T_DOUBLE;
+            case node::T_SYMBOL: case node::T_LOCAL: {
+                int k = var(n);
+                read(k);
+                load(k, types[k]);
+                return types[k];}
+            case node::T_LIST:
+                break;
+            default:
+                ok = false;
+                return node::T_NIL;
+            }
+            list_object &v = n.v_list();
+            size_t len = v.size();
+            if (len == 0) return node::T_NIL;
+            int b = builtin_of(v[0]);
+            switch (b) {
+            case node::PLUS: case node::MINUS: case node::MUL: case node::DIV:
+                return arith(b, v);
+            case node::LT: case node::GT: case node::LTE: case node::GTE: case node::EQEQ: case node::NOTEQ:
+                return compare(b, v);
+            case node::ANDAND: case node::OROR:
+                return logic(b, v);
+            case node::PERCENT:
+                if (len != 3) break;
+                convert(value(v[1]), node::T_INT);
+                operand(v[2], node::T_INT);
+                op({0x99, 0xF7, 0xF9, 0x89, 0xD0}); // cdq; idiv ecx; mov eax, edx
+                return node::T_INT;
+            case node::NOT:
+                if (len != 2 || value(v[1]) != node::T_BOOL) break;
+                op({0x83, 0xF0, 0x01}); // xor eax, 1
+                return node::T_BOOL;
+            case node::INC: case node::DEC: {
+                if (len != 2) break;
+                int t = value(v[1]);
+                if (t == node::T_INT) {
+                    op({0x83, b == node::INC ? 0xC0 : 0xE8, 0x01}); // add or sub eax, 1
+                }
+                else if (t == node::T_DOUBLE) {
+                    double_imm(1.0, 1);
+                    op({0xF2, 0x0F, b == node::INC ? 0x58 : 0x5C, 0xC1});
+                }
+                else break;
+                return t;}
+            case node::SQRT:
+                if (len != 2) break;
+                convert(value(v[1]), node::T_DOUBLE);
+                op({0xF2, 0x0F, 0x51, 0xC0}); // sqrtsd xmm0, xmm0
+                return node::T_DOUBLE;
+            case node::INT: case node::DOUBLE: {
+                if (len != 2) break;
+                int t = b == node::INT ? node::T_INT : node::T_DOUBLE;
+                convert(value(v[1]), t);
+                return t;}
+            case node::SET:
+                if (len != 3) break;
+                assign(v[1], value(v[2]));
+                return node::T_NIL;
+            case node::PLUSPLUS: case node::MINUSMINUS: {
+                if (len != 2 || (v[1].type != node::T_SYMBOL && v[1].type != node::T_LOCAL)) break;
+                int k = var(v[1]);
+                int t = types[k];
+                read(k);
+                if (!number(t)) break;
+                load(k, t);
+                if (t == node::T_INT) {
+                    op({0x83, b == node::PLUSPLUS ? 0xC0 : 0xE8, 0x01});
+                }
+                else {
+                    double_imm(1.0, 1);
+                    op({0xF2, 0x0F, b == node::PLUSPLUS ? 0x58 : 0x5C, 0xC1});
+                }
+                store(k, t);
+                loop.updated[k] = true;
+                return node::T_NIL;}
+            case node::IF: {
+                if (len != 4 || value(v[1]) != node::T_BOOL) break;
+                op({0x85, 0xC0});
+                int other = jump({0x0F, 0x84});
+                vector<bool> saved = written;
+                int t1 = value(v[2]);
+                int end = jump({0xE9});
+                vector<bool> after = written;
+                restore(saved);
+                patch(other);
+                int t2 = value(v[3]);
+                patch(end);
+                for (size_t k = 0; k < after.size(); k++) written[k] = written[k] && after[k];
+                return t1 == t2 ? t1 : node::T_NIL;}
+            case node::WHEN: {
+                if (len < 3 || value(v[1]) != node::T_BOOL) break;
+                op({0x85, 0xC0});
+                int end = jump({0x0F, 0x84});
+                statements(v, 2);
+                patch(end);
+                return node::T_NIL;}
+            case node::BEGIN: {
+                int t = node::T_NIL;
+                for (size_t i = 1; i < len; i++) t = value(v[i]);
+                return t;}
+            case node::FOR: {
+                if (len < 5) break;
+                int t = value(v[2]);
+                if (!number(t)) break;
+                assign(v[1], t);
+                if (!ok) break;
+                int k = var(v[1]);
+                int last = hidden(), step = hidden();
+                convert(value(v[3]), t);
+                store(last, t);
+                convert(value(v[4]), t);
+                store(step, t);
+                loop_for(k, t, last, step, v);
+                return node::T_NIL;}
+            case node::WHILE:
+                if (len < 2) break;
+                loop_while(v);
+                return node::T_NIL;
+            }
+            ok = false;
+            return node::T_NIL;
+        }
+    public:
+        loop_compiler(paren &p, environment &env, native_loop &loop): p(p), env(env), loop(loop), ok(true) {}
+
+        // code of the iterations of loop form n still to run. bounds are the last and step of a for
+        bool compile(node &n, const node *bounds) {
+            list_object &v = n.v_list();
+            op({0x53, 0x48, 0x89, 0xFB}); // push rbx; mov rbx, rdi
+            if (bounds != NULL) {
+                if (v.size() < 5) return false;
+                int t = bounds[0].type;
+                int k = var(v[1]);
+                if (types[k] != t || !ok) return false;
+                loop.assigned[k] = true;
+                loop.last = hidden();
+                loop.step = hidden();
+                loop_for(k, t, loop.last, loop.step, v);
+            }
+            else {
+                if (v.size() < 2) return false;
+                loop_while(v);
+            }
+            op({0x5B, 0xC3}); // pop rbx; ret
+            if (!ok) return false;
+            size_t size = code.size();
+            void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m == MAP_FAILED) return false;
+            memcpy(m, code.data(), size);
+            if (mprotect(m, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(m, size);
+                return false;
+            }
+            loop.code = (void (*)(node *)) m;
+            loop.size = size;
+            return true;
+        }
+    };
+#endif
+
+    // runs the machine code of loop n, that is for if bounds has its last and step, else while.
+    // false if the variables do not have the types it was compiled for: then it is rewritten back
+    static bool run_native(paren &p, node &n, environment &env, const node *bounds, int &heat) {
+        node &head = n.v_list()[0];
+        native_loop &l = *p.native->loops[(head.v_int - node::NATIVE) / 2];
+        node slots[LOOP_SLOTS];
+        node *addr[LOOP_SLOTS];
+        int count = l.vars.size();
+        bool fits = true;
+        for (int k = 0; k < count && fits; k++) {
+            node &sym = l.vars[k];
+            addr[k] = NULL;
+            if (sym.type == node::T_NIL) continue; // a bound
+            node *v = variable(sym, env);
+            if (!l.assigned[k]) {
+                fits = v != NULL && v->type == l.types[k];
+            }
+            else if (sym.type == node::T_SYMBOL && &env != &p.global_env) {
+                fits = false; // set would define it in the frame
+            }
+            else {
+                node *b = &binding(sym, env);
+                if (b->type == node::T_NIL) fits = !l.read_first[k]; // reads before it is set would find an outer one
+                else fits = v == b && b->type == l.types[k];
+                v = b;
+            }
+            addr[k] = v;
+        }
+        for (int k = 0; k < count && fits; k++) { // a variable changed is not also another
+            if ((!l.assigned[k] && !l.updated[k]) || addr[k] == NULL) continue;
+            for (int j = 0; j < count; j++) {
+                if (j != k && addr[j] == addr[k]) fits = false;
+            }
+        }
+        if (!fits) {
+            if (!p.gc.shared) {
+                head = builtin(generic(head.v_int));
+                p.stats.loops_deoptimized++;
+                heat = COLD_LOOP;
+            }
+            return false;
+        }
+        for (int k = 0; k < count; k++) {
+            if (addr[k] != NULL) slots[k] = *addr[k];
+        }
+        if (bounds != NULL) {
+            slots[l.last] = bounds[0];
+            slots[l.step] = bounds[1];
+        }
+        l.code(slots);
+        for (int k = 0; k < count; k++) {
+            if (addr[k] != NULL && (l.assigned[k] || l.updated[k])) *addr[k] = slots[k];
+        }
+        return true;
+    }
+
+    // compiles loop n, hot while it runs, and runs the rest of its iterations in machine code. false
+    // if it cannot be compiled
+    static bool enter_native(paren &p, node &n, environment &env, const node *bounds, int &heat) {
+#ifdef PAREN_NATIVE
+        native_loop *l = new native_loop;
+        loop_compiler c(p, env, *l);
+        if (c.compile(n, bounds)) {
+            int k = p.native->loops.size();
+            p.native->loops.push_back(l);
+            p.stats.loops_compiled++;
+            n.v_list()[0] = builtin(node::NATIVE + 2 * k + (bounds == NULL));
+            return run_native(p, n, env, bounds, heat);
+        }
+        delete l;
+#endif
+        heat = COLD_LOOP;
+        return false;
+    }
+
+    node paren::eval(node &n0, environment &env0) {
+        node *tail = &n0; // evaluated by the next iteration instead of a recursive call
+        environment *tail_env = &env0;
+        activation frame(*this); // of the innermost call in tail position
+        while (true) {
+            node &n = *tail;
+            environment &env = *tail_env;
+            switch (n.type) {
+            case node::T_NIL:
+            case node::T_INT:
+            case node::T_DOUBLE:
+            case node::T_BOOL:
+            case node::T_STRING:
+            case node::T_BUILTIN:
+            case node::T_FN:
+            case node::T_SEQ:
+                {
+                    return n;
+                }
+            case node::T_SYMBOL:
+            case node::T_LOCAL:
+                {
+                    node *n2 = variable(n, env);
+                    if (n2 != NULL && n2->type != node::T_NIL)
+                        return *n2;
+                    else {
+                        int b = n.v_int < (int) builtin_ids.size() ? builtin_ids[n.v_int] : -1;
+                        if (b >= 0) {
+                            if (gc.shared) return builtin(b); // other threads may be reading the code
+                            n = builtin(b); // elementary just-in-time compilation
+                            return n;
+                        }
+                        else {
+                            *err << "Unknown variable: " << n.v_string() << endl;
+                            return node();
+                        }
+                    }
+
+                }
+            case node::T_LIST: // function (FUNCTION ARGUMENT ..)
+                {
+                    if (n.v_list().size() == 0) return node();
+                    node func = callee(n, env);
+                    int builtin = -1;
+                    if (func.type == node::T_BUILTIN) {
+                        builtin = func.v_int;
+                        if (profiling != NULL && !heap::worker()) frame.profile_builtin(builtin);
+                        switch(builtin < node::NATIVE ? builtin : generic(builtin)) {
+                            case node::PLUS: // (+ X ..)
+                                {
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (len == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
+                                    if (first.type == node::T_VEC) {
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            first = binary(*this, builtin, first, eval(*i, env));
+                                        }
+                                        return first;
+                                    }
+                                    if (first.type == node::T_INT) {
+                                        int sum = first.v_int;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum += eval(*i, env).to_int();
+                                        }
+                                        return node(sum);
+                                    }
+                                    else {
+                                        double sum = first.v_double;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum += eval(*i, env).to_double();
+                                        }
+                                        return node(sum);
                                     }
-                                    return node(acc);
                                 }
-                                else {
-                                    double acc = first.v_double;
-                                    for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                        acc /= eval(*i, env).to_double();
+                            case node::MINUS: // (- X ..)
+                                {
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (len == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
+                                    if (first.type == node::T_VEC) {
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            first = binary(*this, builtin, first, eval(*i, env));
+                                        }
+                                        return first;
+                                    }
+                                    if (first.type == node::T_INT) {
+                                        int sum = first.v_int;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum -= eval(*i, env).to_int();
+                                        }
+                                        return node(sum);
+                                    }
+                                    else {
+                                        double sum = first.v_double;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum -= eval(*i, env).to_double();
+                                        }
+                                        return node(sum);
                                     }
-                                    return node(acc);
                                 }
-                            }
-                        case node::CARET: { // (^ BASE EXPONENT)
-                            return node(pow(eval(n.v_list[1], env).to_double(), eval(n.v_list[2], env).to_double()));}
-                        case node::PERCENT: { // (% DIVIDEND DIVISOR)
-                            return node(eval(n.v_list[1], env).to_int() % eval(n.v_list[2], env).to_int());}
-                        case node::SQRT: { // (sqrt X)
-                            return node(sqrt(eval(n.v_list[1], env).to_double()));}
-                        case node::INC: { // (inc X)
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
+                            case node::MUL: // (* X ..)
+                                {
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(1);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (len == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
+                                    if (first.type == node::T_VEC) {
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            first = binary(*this, builtin, first, eval(*i, env));
+                                        }
+                                        return first;
+                                    }
+                                    if (first.type == node::T_INT) {
+                                        int sum = first.v_int;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum *= eval(*i, env).to_int();
+                                        }
+                                        return node(sum);
+                                    }
+                                    else {
+                                        double sum = first.v_double;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            sum *= eval(*i, env).to_double();
+                                        }
+                                        return node(sum);
+                                    }
+                                }
+                            case node::DIV: // (/ X ..)
+                                {
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(1);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (len == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
+                                    if (first.type == node::T_VEC) {
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            first = binary(*this, builtin, first, eval(*i, env));
+                                        }
+                                        return first;
+                                    }
+                                    if (first.type == node::T_INT) {
+                                        int acc = first.v_int;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            acc /= eval(*i, env).to_int();
+                                        }
+                                        return node(acc);
+                                    }
+                                    else {
+                                        double acc = first.v_double;
+                                        for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                            acc /= eval(*i, env).to_double();
+                                        }
+                                        return node(acc);
+                                    }
+                                }
+                            case node::CARET: { // (^ BASE EXPONENT)
+                                return node(pow(eval(n.v_list()[1], env).to_double(), eval(n.v_list()[2], env).to_double()));}
+                            case node::PERCENT: { // (% DIVIDEND DIVISOR)
+                                return node(eval(n.v_list()[1], env).to_int() % eval(n.v_list()[2], env).to_int());}
+                            case node::SQRT: { // (sqrt X)
+                                node x = eval(n.v_list()[1], env);
+                                if (x.type == node::T_VEC) return vec_sqrt(x);
+                                return node(sqrt(x.to_double()));}
+                            case node::INC: { // (inc X)
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (first.type == node::T_INT) {
+                                        return node(first.v_int + 1);
+                                    }
+                                    else {
+                                        return node(first.v_double + 1.0);
+                                    }
+                                }
+                            case node::DEC: { // (dec X)
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (first.type == node::T_INT) {
+                                        return node(first.v_int - 1);
+                                    }
+                                    else {
+                                        return node(first.v_double - 1.0);
+                                    }
+                                }
+                            case node::PLUSPLUS: { // (++ X)
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (first.type == node::T_INT) {
+                                        if (node *v = variable(n.v_list()[1], env)) v->v_int++;
+                                        return node();
+                                    }
+                                    else {
+                                        if (node *v = variable(n.v_list()[1], env)) v->v_double++;
+                                        return node();
+                                    }
+                                }
+                            case node::MINUSMINUS: { // (-- X)
+                                    int len = n.v_list().size();
+                                    if (len <= 1) return node(0);
+                                    node first = eval(n.v_list()[1], env);
+                                    if (first.type == node::T_INT) {
+                                        if (node *v = variable(n.v_list()[1], env)) v->v_int--;
+                                        return node();
+                                    }
+                                    else {
+                                        if (node *v = variable(n.v_list()[1], env)) v->v_double--;
+                                        return node();
+                                    }
+                                }
+                            case node::FLOOR: { // (floor X)
+                                return node(floor(eval(n.v_list()[1], env).to_double()));}
+                            case node::CEIL: { // (ceil X)
+                                return node(ceil(eval(n.v_list()[1], env).to_double()));}
+                            case node::LN: { // (ln X)
+                                return node(log(eval(n.v_list()[1], env).to_double()));}
+                            case node::LOG10: { // (log10 X)
+                                return node(log10(eval(n.v_list()[1], env).to_double()));}
+                            case node::RAND: { // (rand)
+                                return node(rand_double());}
+                            case node::SET: // (set SYMBOL VALUE)
+                                {
+                                    node value = eval(n.v_list()[2], env);
+                                    binding(n.v_list()[1], env) = value;
+                                    return node();
+                                }
+                            case node::EQEQ: { // (== X ..) short-circuit
+                                node first = eval(n.v_list()[1], env);
+                                if (n.v_list().size() == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
                                 if (first.type == node::T_INT) {
-                                    return node(first.v_int + 1);
+                                    int firstv = first.v_int;
+                                    for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                        if (eval(*i, env).to_int() != firstv) {return node(false);}
+                                    }
                                 }
                                 else {
-                                    return node(first.v_double + 1.0);
+                                    double firstv = first.v_double;
+                                    for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                        if (eval(*i, env).to_double() != firstv) {return node(false);}
+                                    }
                                 }
-                            }
-                        case node::DEC: { // (dec X)
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
+                                return node(true);}
+                            case node::NOTEQ: { // (!= X ..) short-circuit
+                                node first = eval(n.v_list()[1], env);
+                                if (n.v_list().size() == 3) return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));
                                 if (first.type == node::T_INT) {
-                                    return node(first.v_int - 1);
+                                    int firstv = first.v_int;
+                                    for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                        if (eval(*i, env).to_int() == firstv) {return node(false);}
+                                    }
                                 }
                                 else {
-                                    return node(first.v_double - 1.0);
+                                    double firstv = first.v_double;
+                                    for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                        if (eval(*i, env).to_double() == firstv) {return node(false);}
+                                    }
                                 }
-                            }
-                        case node::PLUSPLUS: { // (++ X)
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    env.get(n.v_list[1].v_string).v_int++;
-                                    return node();
+                                return node(true);}
+                            case node::LT: { // (< X Y)
+                                node first = eval(n.v_list()[1], env);
+                                return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));}
+                            case node::GT: { // (> X Y)
+                                node first = eval(n.v_list()[1], env);
+                                return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));}
+                            case node::LTE: { // (<= X Y)
+                                node first = eval(n.v_list()[1], env);
+                                return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));}
+                            case node::GTE: { // (>= X Y)
+                                node first = eval(n.v_list()[1], env);
+                                return specialize(*this, n, builtin, first, eval(n.v_list()[2], env));}
+                            case node::ANDAND: { // (&& X ..) short-circuit
+                                for (auto i = n.v_list().begin() + 1; i != n.v_list().end(); i++) {
+                                    if (!eval(*i, env).v_bool) {return node(false);}
+                                }
+                                return node(true);}
+                            case node::OROR: { // (|| X ..) short-circuit
+                                for (auto i = n.v_list().begin() + 1; i != n.v_list().end(); i++) {
+                                    if (eval(*i, env).v_bool) {return node(true);}
+                                }
+                                return node(false);}
+                            case node::NOT: { // (! X)
+                                return node(!(eval(n.v_list()[1], env).v_bool));}
+                            case node::IF: { // (if CONDITION THEN_EXPR ELSE_EXPR)
+                                node &cond = n.v_list()[1];
+                                if (eval(cond, env).v_bool) {
+                                    tail = &n.v_list()[2];
                                 }
                                 else {
-                                    env.get(n.v_list[1].v_string).v_double++;
-                                    return node();
+                                    tail = &n.v_list()[3];
                                 }
-                            }
-                        case node::MINUSMINUS: { // (-- X)
-                                int len = n.v_list.size();
-                                if (len <= 1) return node(0);
-                                node first = eval(n.v_list[1], env);
-                                if (first.type == node::T_INT) {
-                                    env.get(n.v_list[1].v_string).v_int--;
+                                continue;}
+                            case node::WHEN: { // (when CONDITION EXPR ..)
+                                node &cond = n.v_list()[1];
+                                if (eval(cond, env).v_bool) {
+                                    int len = n.v_list().size();
+                                    for (int i = 2; i < len - 1; i++) {
+                                        eval(n.v_list()[i], env);
+                                    }
+                                    tail = &n.v_list()[len - 1]; // returns last EXPR
+                                    continue;
+                                }
+                                return node();}
+                            case node::FOR: // (for SYMBOL START END STEP EXPR ..)
+                                {
+                                    node start = eval(n.v_list()[2], env);
+                                    node &var = binding(n.v_list()[1], env);
+                                    var = start;
+                                    int len = n.v_list().size();
+                                    int cold = INT_MIN;
+                                    int &heat = loop_heat(*this, n, cold);
+                                    if (start.type == node::T_INT) {
+                                        int last = eval(n.v_list()[3], env).to_int();
+                                        int step = eval(n.v_list()[4], env).to_int();
+                                        node bounds[2] = {node(last), node(step)};
+                                        if (builtin >= node::NATIVE && run_native(*this, n, env, bounds, heat)) return node();
+                                        int &a = var.v_int;
+                                        if (step >= 0) {
+                                            for (; a <= last; a += step) {
+                                                if (++heat >= HOT_LOOP && enter_native(*this, n, env, bounds, heat)) return node();
+                                                for (int i = 5; i < len; i++) {
+                                                    eval(n.v_list()[i], env);
+                                                }
+                                            }
+                                        }
+                                        else {
+                                            for (; a >= last; a += step) {
+                                                if (++heat >= HOT_LOOP && enter_native(*this, n, env, bounds, heat)) return node();
+                                                for (int i = 5; i < len; i++) {
+                                                    eval(n.v_list()[i], env);
+                                                }
+                                            }
+                                        }
+                                    }
+                                    else {
+                                        double last = eval(n.v_list()[3], env).to_double();
+                                        double step = eval(n.v_list()[4], env).to_double();
+                                        node bounds[2] = {node(last), node(step)};
+                                        if (start.type == node::T_DOUBLE && builtin >= node::NATIVE && run_native(*this, n, env, bounds, heat)) return node();
+                                        double &a = var.v_double;
+                                        if (step >= 0) {
+                                            for (; a <= last; a += step) {
+                                                if (++heat >= HOT_LOOP && start.type == node::T_DOUBLE && enter_native(*this, n, env, bounds, heat)) return node();
+                                                for (int i = 5; i < len; i++) {
+                                                    eval(n.v_list()[i], env);
+                                                }
+                                            }
+                                        }
+                                        else {
+                                            for (; a >= last; a += step) {
+                                                if (++heat >= HOT_LOOP && start.type == node::T_DOUBLE && enter_native(*this, n, env, bounds, heat)) return node();
+                                                for (int i = 5; i < len; i++) {
+                                                    eval(n.v_list()[i], env);
+                                                }
+                                            }
+                                        }
+                                    }
                                     return node();
                                 }
+                            case node::WHILE: { // (while CONDITION EXPR ..)
+                                node &cond = n.v_list()[1];
+                                int len = n.v_list().size();
+                                int cold = INT_MIN;
+                                int &heat = loop_heat(*this, n, cold);
+                                if (builtin >= node::NATIVE && run_native(*this, n, env, NULL, heat)) return node();
+                                while (true) {
+                                    if (++heat >= HOT_LOOP && enter_native(*this, n, env, NULL, heat)) return node();
+                                    if (!eval(cond, env).v_bool) break;
+                                    for (int i = 2; i < len; i++) {
+                                        eval(n.v_list()[i], env);
+                                    }
+                                }
+                                return node(); }
+                            case node::STRLEN: { // (strlen X)
+                                node tmp;
+                                const node &s = eval_ref(n.v_list()[1], env, tmp);
+                                if (s.type != node::T_STRING) return node(0);
+                                return node((int) str_of(s)->size());}
+                            case node::STRCAT: { // (strcat X ..)
+                                int len = n.v_list().size();
+                                if (len <= 1) return node("");
+                                node first = eval(n.v_list()[1], env);
+                                string rest; // of the values at the time they are evaluated
+                                for (auto i = n.v_list().begin() + 2; i != n.v_list().end(); i++) {
+                                    node x = eval(*i, env);
+                                    if (x.type == node::T_STRING) rest += str_of(x)->view(); else rest += x.to_str();
+                                }
+                                return append(*this, first, rest);}
+                            case node::CHAR_AT: { // (char-at X)
+                                node s = eval(n.v_list()[1], env);
+                                int i = eval(n.v_list()[2], env).v_int;
+                                if (s.type != node::T_STRING) return node(0);
+                                return node(str_of(s)->view()[i]);}
+                            case node::CHR: { // (chr X)
+                                char temp[2] = " ";
+                                temp[0] = (char) eval(n.v_list()[1], env).v_int;
+                                return node(string(temp));}
+                            case node::STRING: { // (string X)
+                                return node(eval(n.v_list()[1], env).to_str());}
+                            case node::DOUBLE: { // (double X)
+                                return node(eval(n.v_list()[1], env).to_double());}
+                            case node::INT: { // (int X)
+                                return node(eval(n.v_list()[1], env).to_int());}
+                            case node::READ_STRING: { // (read-string X)
+                                return node(parse(eval(n.v_list()[1], env).to_str())[0]);}
+                            case node::TYPE: { // (type X)
+                                return node(eval(n.v_list()[1], env).type_str());}
+                            case node::EVAL: { // (eval X)
+                                node n2 = clone(eval(n.v_list()[1], env)); // evaluation rewrites code in place
+                                return node(eval(n2, env));}
+                            case node::QUOTE: { // (quote X)
+                                return n.v_list()[1];}
+                            case node::FN: { // (fn (ARGUMENT ..) BODY) => lexical closure
+                                if (gc.shared) {
+                                    lock_guard<mutex> l(lock);
+                                    resolver(*this, env).fn_form(n);
+                                }
                                 else {
-                                    env.get(n.v_list[1].v_string).v_double--;
-                                    return node();
+                                    resolver(*this, env).fn_form(n);
                                 }
-                            }
-                        case node::FLOOR: { // (floor X)
-                            return node(floor(eval(n.v_list[1], env).to_double()));}
-                        case node::CEIL: { // (ceil X)
-                            return node(ceil(eval(n.v_list[1], env).to_double()));}
-                        case node::LN: { // (ln X)
-                            return node(log(eval(n.v_list[1], env).to_double()));}
-                        case node::LOG10: { // (log10 X)
-                            return node(log10(eval(n.v_list[1], env).to_double()));}
-                        case node::RAND: { // (rand)
-                            return node(rand_double());}
-                        case node::SET: // (set SYMBOL VALUE)
-                            {
-                                env.env[n.v_list[1].v_string] = eval(n.v_list[2], env);
-                                return node();
-                            }
-                        case node::EQEQ: { // (== X ..) short-circuit
-                            node first = eval(n.v_list[1], env);
-                            if (first.type == node::T_INT) {
-                                int firstv = first.v_int;
-                                for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                    if (eval(*i, env).to_int() != firstv) {return node(false);}
+                                node n2 = fn(*this, n, &env);
+                                return n2;}
+                            case node::LIST: { // (list X ..)
+                                vector<node> ret;
+                                gc_root root(gc, ret);
+                                for (unsigned int i = 1; i < n.v_list().size(); i++) {
+                                    ret.push_back(eval(n.v_list()[i], env));
                                 }
-                            }
-                            else {
-                                double firstv = first.v_double;
-                                for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                    if (eval(*i, env).to_double() != firstv) {return node(false);}
+                                return node(std::move(ret));}
+                            case node::APPLY: { // (apply FUNC LIST)
+                                node f = eval(n.v_list()[1], env);
+                                node l = eval(n.v_list()[2], env); // a handle: the list is not copied
+                                if (l.type == node::T_VEC && f.type == node::T_BUILTIN && f.v_int == node::PLUS) return vec_reduce(*this, node::SUM, l, l);
+                                if (streams(l)) {
+                                    if (f.type == node::T_BUILTIN && f.v_int <= node::DIV) return fold(*seq_of(l), f.v_int);
+                                    vector<node> args; // the items straight from the pipeline
+                                    gc_root root(gc, args);
+                                    each(*seq_of(l), [&](const node &x) {args.push_back(x);});
+                                    return call(f, args.data(), args.size(), env);
                                 }
+                                const list_object &lst = l.v_list();
+                                if (lst.data() != NULL) return call(f, lst.data(), lst.size(), env);
+                                vector<node> args(lst.begin(), lst.end()); // spans leaves of the trie
+                                gc_root root(gc, args);
+                                return call(f, args.data(), args.size(), env);
                             }
-                            return node(true);}
-                        case node::NOTEQ: { // (!= X ..) short-circuit
-                            node first = eval(n.v_list[1], env);
-                            if (first.type == node::T_INT) {
-                                int firstv = first.v_int;
-                                for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                    if (eval(*i, env).to_int() == firstv) {return node(false);}
+                            case node::MAP: { // (map FUNC LIST)
+                                node f = eval(n.v_list().at(1), env);
+                                node l = eval(n.v_list().at(2), env);
+                                if (streams(l)) return node(node::T_SEQ, seq_of(l)->then(f, false));
+                                const list_object &lst = l.v_list();
+                                vector<node> acc;
+                                gc_root root(gc, acc);
+                                acc.reserve(lst.size());
+                                for (unsigned int i = 0; i < lst.size(); i++) {
+                                    acc.push_back(call(f, &lst[i], 1, env));
                                 }
+                                return node(std::move(acc));
                             }
-                            else {
-                                double firstv = first.v_double;
-                                for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                    if (eval(*i, env).to_double() == firstv) {return node(false);}
+                            case node::FILTER: { // (filter FUNC LIST)
+                                node f = eval(n.v_list().at(1), env);
+                                node l = eval(n.v_list().at(2), env);
+                                if (streams(l)) return node(node::T_SEQ, seq_of(l)->then(f, true));
+                                const list_object &lst = l.v_list();
+                                vector<node> acc;
+                                gc_root root(gc, acc);
+                                for (unsigned int i = 0; i < lst.size(); i++) {
+                                    if (call(f, &lst[i], 1, env).v_bool) acc.push_back(lst[i]);
                                 }
+                                return node(std::move(acc));
                             }
-                            return node(true);}
-                        case node::LT: { // (< X Y)
-                            node first = eval(n.v_list[1], env);
-                            node second = eval(n.v_list[2], env);
-                            if (first.type == node::T_INT) {
-                                return node(first.v_int < second.to_int());
-                            }
-                            else {
-                                return node(first.v_double < second.to_double());
-                            }}
-                        case node::GT: { // (> X Y)
-                            node first = eval(n.v_list[1], env);
-                            node second = eval(n.v_list[2], env);
-                            if (first.type == node::T_INT) {
-                                return node(first.v_int > second.to_int());
-                            }
-                            else {
-                                return node(first.v_double > second.to_double());
-                            }}
-                        case node::LTE: { // (<= X Y)
-                            node first = eval(n.v_list[1], env);
-                            node second = eval(n.v_list[2], env);
-                            if (first.type == node::T_INT) {
-                                return node(first.v_int <= second.to_int());
-                            }
-                            else {
-                                return node(first.v_double <= second.to_double());
-                            }}
-                        case node::GTE: { // (>= X Y)
-                            node first = eval(n.v_list[1], env);
-                            node second = eval(n.v_list[2], env);
-                            if (first.type == node::T_INT) {
-                                return node(first.v_int >= second.to_int());
-                            }
-                            else {
-                                return node(first.v_double >= second.to_double());
-                            }}
-                        case node::ANDAND: { // (&& X ..) short-circuit
-                            for (auto i = n.v_list.begin() + 1; i != n.v_list.end(); i++) {
-                                if (!eval(*i, env).v_bool) {return node(false);}
+                            case node::REDUCE: { // (reduce FUNC INIT LIST) => (FUNC .. (FUNC (FUNC INIT X1) X2) .. XN)
+                                node f = eval(n.v_list().at(1), env);
+                                node acc = eval(n.v_list().at(2), env);
+                                node l = eval(n.v_list().at(3), env);
+                                node args[2];
+                                if (streams(l)) {
+                                    each(*seq_of(l), [&](const node &x) {
+                                        args[0] = acc;
+                                        args[1] = x;
+                                        acc = call(f, args, 2, env);
+                                    });
+                                    return acc;
+                                }
+                                const list_object &lst = l.v_list();
+                                for (unsigned int i = 0; i < lst.size(); i++) {
+                                    args[0] = acc;
+                                    args[1] = lst[i];
+                                    acc = call(f, args, 2, env);
+                                }
+                                return acc;
                             }
-                            return node(true);}
-                        case node::OROR: { // (|| X ..) short-circuit
-                            for (auto i = n.v_list.begin() + 1; i != n.v_list.end(); i++) {
-                                if (eval(*i, env).v_bool) {return node(true);}
+                            case node::PMAP: { // (pmap FUNC LIST) => map on the thread pool
+                                node f = eval(n.v_list().at(1), env);
+                                node l = eval(n.v_list().at(2), env);
+                                const list_object &lst = l.v_list();
+                                vector<node> acc(lst.size());
+                                gc_root root(gc, acc);
+                                parallel_for(*this, lst.size(), [&](size_t from, size_t to) {
+                                    for (size_t i = from; i < to; i++) acc[i] = call(f, &lst[i], 1, env);
+                                });
+                                return node(acc);
                             }
-                            return node(false);}
-                        case node::NOT: { // (! X)
-                            return node(!(eval(n.v_list[1], env).v_bool));}
-                        case node::IF: { // (if CONDITION THEN_EXPR ELSE_EXPR)
-                            node &cond = n.v_list[1];
-                            if (eval(cond, env).v_bool) {
-                                return eval(n.v_list[2], env);
+                            case node::PFILTER: { // (pfilter FUNC LIST) => filter on the thread pool
+                                node f = eval(n.v_list().at(1), env);
+                                node l = eval(n.v_list().at(2), env);
+                                const list_object &lst = l.v_list();
+                                vector<char> keep(lst.size());
+                                parallel_for(*this, lst.size(), [&](size_t from, size_t to) {
+                                    for (size_t i = from; i < to; i++) keep[i] = call(f, &lst[i], 1, env).v_bool;
+                                });
+                                vector<node> acc;
+                                gc_root root(gc, acc);
+                                for (size_t i = 0; i < lst.size(); i++) {
+                                    if (keep[i]) acc.push_back(lst[i]);
+                                }
+                                return node(acc);
                             }
-                            else {
-                                return eval(n.v_list[3], env);
-                            }}
-                        case node::WHEN: { // (when CONDITION EXPR ..)
-                            node &cond = n.v_list[1];
-                            if (eval(cond, env).v_bool) {
-                                int len = n.v_list.size();
-                                for (int i = 2; i < len - 1; i++) {
-                                    eval(n.v_list[i], env);
-                                }
-                                return eval(n.v_list[len - 1], env); // returns last EXPR
+                            case node::PREDUCE: { // (preduce FUNC INIT LIST) => reduce on the thread pool. FUNC must be associative, with INIT its identity
+                                node f = eval(n.v_list().at(1), env);
+                                node init = eval(n.v_list().at(2), env);
+                                node l = eval(n.v_list().at(3), env);
+                                const list_object &lst = l.v_list();
+                                vector<pair<size_t, node> > parts; // start and result of each range
+                                mutex m;
+                                parallel_for(*this, lst.size(), [&](size_t from, size_t to) {
+                                    node args[2] = {init, node()};
+                                    for (size_t i = from; i < to; i++) {
+                                        args[1] = lst[i];
+                                        args[0] = call(f, args, 2, env);
+                                    }
+                                    lock_guard<mutex> l(m);
+                                    parts.push_back(make_pair(from, args[0]));
+                                });
+                                sort(parts.begin(), parts.end(), [](const pair<size_t, node> &a, const pair<size_t, node> &b) {return a.first < b.first;});
+                                vector<node> results;
+                                gc_root root(gc, results);
+                                for (size_t i = 0; i < parts.size(); i++) results.push_back(parts[i].second);
+                                node acc = init;
+                                node args[2];
+                                for (size_t i = 0; i < results.size(); i++) {
+                                    args[0] = acc;
+                                    args[1] = results[i];
+                                    acc = call(f, args, 2, env);
+                                }
+                                return acc;
                             }
-                            return node();}
-                        case node::FOR: // (for SYMBOL START END STEP EXPR ..)
-                            {
-                                node start = eval(n.v_list[2], env);
-                                env.env[n.v_list[1].v_string] = start;
-                                int len = n.v_list.size();
+                            case node::RANGE: { // (range START END STEP) => lazy sequence
+                                node start = eval(n.v_list().at(1), env);
+                                node last = eval(n.v_list().at(2), env);
+                                node step = eval(n.v_list().at(3), env);
                                 if (start.type == node::T_INT) {
-                                    int last = eval(n.v_list[3], env).to_int();
-                                    int step = eval(n.v_list[4], env).to_int();
-                                    int &a = env.get(n.v_list[1].v_string).v_int;
-                                    if (step >= 0) {
-                                        for (; a <= last; a += step) {
-                                            for (int i = 5; i < len; i++) {
-                                                eval(n.v_list[i], env);
-                                            }
-                                        }
+                                    last = node(last.to_int());
+                                    step = node(step.to_int());
+                                }
+                                else {
+                                    start = node(start.to_double());
+                                    last = node(last.to_double());
+                                    step = node(step.to_double());
+                                }
+                                return node(node::T_SEQ, new seq_object(this, start, last, step));
+                            }
+                            case node::NTH: { // (nth INDEX LIST)
+                                node i = eval(n.v_list().at(1), env);
+                                node tmp;
+                                const node &l = eval_ref(n.v_list().at(2), env, tmp);
+                                if (i.type == node::T_INT && l.type == node::T_LIST && n.v_list().size() == 3) requicken(*this, n, node::NTH_LIST);
+                                if (l.type == node::T_VEC) return vec_of(l)->at(i.v_int);
+                                return l.v_list().at(i.v_int);}
+                            case node::NTH_LIST: { // (nth INDEX LIST) that has met an int and a list
+                                node tmp;
+                                node i = eval_ref(n.v_list()[1], env, tmp);
+                                const node &l = eval_ref(n.v_list()[2], env, tmp);
+                                if (i.type == node::T_INT && l.type == node::T_LIST) return list_of(l)->at(i.v_int);
+                                requicken(*this, n, node::NTH);
+                                return l.v_list().at(i.v_int);}
+                            case node::PLUS_II: case node::MINUS_II: case node::MUL_II: case node::DIV_II: case node::EQEQ_II:
+                            case node::NOTEQ_II: case node::LT_II: case node::GT_II: case node::LTE_II: case node::GTE_II: {
+                                // (OP X Y) that has met two ints
+                                node tmp;
+                                node a = eval_ref(n.v_list()[1], env, tmp);
+                                const node &b = eval_ref(n.v_list()[2], env, tmp);
+                                if (a.type == node::T_INT && b.type == node::T_INT) {
+                                    int x = a.v_int, y = b.v_int;
+                                    switch (builtin) {
+                                    case node::PLUS_II: return node(x + y);
+                                    case node::MINUS_II: return node(x - y);
+                                    case node::MUL_II: return node(x * y);
+                                    case node::DIV_II: return node(x / y);
+                                    case node::EQEQ_II: return node(x == y);
+                                    case node::NOTEQ_II: return node(x != y);
+                                    case node::LT_II: return node(x < y);
+                                    case node::GT_II: return node(x > y);
+                                    case node::LTE_II: return node(x <= y);
+                                    default: return node(x >= y);
                                     }
-                                    else {
-                                        for (; a >= last; a += step) {
-                                            for (int i = 5; i < len; i++) {
-                                                eval(n.v_list[i], env);
-                                            }
-                                        }
+                                }
+                                requicken(*this, n, generic(builtin)); // deoptimize
+                                return binary(*this, generic(builtin), a, b);}
+                            case node::PLUS_DD: case node::MINUS_DD: case node::MUL_DD: case node::DIV_DD: case node::EQEQ_DD:
+                            case node::NOTEQ_DD: case node::LT_DD: case node::GT_DD: case node::LTE_DD: case node::GTE_DD: {
+                                // (OP X Y) that has met two doubles
+                                node tmp;
+                                node a = eval_ref(n.v_list()[1], env, tmp);
+                                const node &b = eval_ref(n.v_list()[2], env, tmp);
+                                if (a.type == node::T_DOUBLE && b.type == node::T_DOUBLE) {
+                                    double x = a.v_double, y = b.v_double;
+                                    switch (builtin) {
+                                    case node::PLUS_DD: return node(x + y);
+                                    case node::MINUS_DD: return node(x - y);
+                                    case node::MUL_DD: return node(x * y);
+                                    case node::DIV_DD: return node(x / y);
+                                    case node::EQEQ_DD: return node(x == y);
+                                    case node::NOTEQ_DD: return node(x != y);
+                                    case node::LT_DD: return node(x < y);
+                                    case node::GT_DD: return node(x > y);
+                                    case node::LTE_DD: return node(x <= y);
+                                    default: return node(x >= y);
                                     }
                                 }
-                                else {
-                                    double last = eval(n.v_list[3], env).to_double();
-                                    double step = eval(n.v_list[4], env).to_double();
-                                    double &a = env.get(n.v_list[1].v_string).v_double;
-                                    if (step >= 0) {
-                                        for (; a <= last; a += step) {
-                                            for (int i = 5; i < len; i++) {
-                                                eval(n.v_list[i], env);
-                                            }
-                                        }
+                                requicken(*this, n, generic(builtin));
+                                return binary(*this, generic(builtin), a, b);}
+                            case node::LENGTH: { // (length LIST)
+                                node tmp;
+                                const node &l = eval_ref(n.v_list().at(1), env, tmp);
+                                if (l.type == node::T_VEC) return node((int) vec_of(l)->size());
+                                if (l.type == node::T_MAP) return node((int) map_of(l)->count);
+                                return node((int) l.v_list().size());}
+                            case node::CONJ: { // (conj LIST X ..) => LIST with X .. appended
+                                node l = eval(n.v_list().at(1), env);
+                                for (unsigned int i = 2; i < n.v_list().size(); i++) {
+                                    node x = eval(n.v_list()[i], env);
+                                    l = node(node::T_LIST, l.v_list().conj(x));
+                                }
+                                return l;}
+                            case node::ASSOC_NTH: { // (assoc-nth INDEX LIST X) => LIST with item INDEX replaced by X
+                                int i = eval(n.v_list().at(1), env).v_int;
+                                node l = eval(n.v_list().at(2), env);
+                                node x = eval(n.v_list().at(3), env);
+                                list_object &lst = l.v_list();
+                                if (i < 0 || i > (int) lst.size()) {
+                                    *err << "Index out of range: " << i << endl;
+                                    return node();
+                                }
+                                return node(node::T_LIST, i == (int) lst.size() ? lst.conj(x) : lst.assoc(i, x));}
+                            case node::SLICE: { // (slice LIST FROM TO) => items FROM up to, not including, TO
+                                node l = eval(n.v_list().at(1), env);
+                                int from = eval(n.v_list().at(2), env).v_int;
+                                int to = eval(n.v_list().at(3), env).v_int;
+                                return node(node::T_LIST, l.v_list().slice(max(from, 0), max(to, 0)));}
+                            case node::F64VEC: // (f64vec LIST) or (f64vec X ..) => the numbers, unboxed
+                            case node::I64VEC: { // (i64vec LIST) or (i64vec X ..)
+                                bool ints = builtin == node::I64VEC;
+                                if (n.v_list().size() == 2) {
+                                    node x = eval(n.v_list()[1], env);
+                                    if (x.type == node::T_VEC) return convert(ints, x);
+                                    if (x.type == node::T_LIST || x.type == node::T_SEQ) return to_vec(ints, x.v_list(), x.v_list().size());
+                                    return to_vec(ints, &x, 1);
+                                }
+                                vector<node> args;
+                                gc_root root(gc, args);
+                                for (unsigned int i = 1; i < n.v_list().size(); i++) {
+                                    args.push_back(eval(n.v_list()[i], env));
+                                }
+                                return to_vec(ints, args, args.size());}
+                            case node::TO_LIST: { // (to-list VECTOR) => its items as a list
+                                node x = eval(n.v_list().at(1), env);
+                                if (x.type == node::T_VEC || x.type == node::T_SEQ) return node(node::T_LIST, &x.v_list());
+                                return x;}
+                            case node::SUM: // (sum VECTOR)
+                            case node::MIN: // (min VECTOR)
+                            case node::MAX: { // (max VECTOR)
+                                node x = eval(n.v_list().at(1), env);
+                                return vec_reduce(*this, builtin, x, x);}
+                            case node::DOT: { // (dot VECTOR VECTOR)
+                                node x = eval(n.v_list().at(1), env);
+                                node y = eval(n.v_list().at(2), env);
+                                return vec_reduce(*this, builtin, x, y);}
+                            case node::HASH_MAP: { // (hash-map KEY VALUE ..) => a map from each KEY to its VALUE
+                                vector<node> args;
+                                gc_root root(gc, args);
+                                for (unsigned int i = 1; i < n.v_list().size(); i++) {
+                                    args.push_back(eval(n.v_list()[i], env));
+                                }
+                                node m(node::T_MAP, new map_object);
+                                for (size_t i = 0; i + 1 < args.size(); i += 2) {
+                                    if (!map_args(*this, m, args[i])) return node();
+                                    map_of(m)->put(args[i]) = args[i + 1];
+                                }
+                                return m;}
+                            case node::GET: // (get MAP KEY [DEFAULT]) => the value of KEY, else DEFAULT or nil
+                            case node::HAS: { // (has? MAP KEY)
+                                node m = eval(n.v_list().at(1), env);
+                                node k = eval(n.v_list().at(2), env);
+                                if (!map_args(*this, m, k)) return node();
+                                {
+                                    unique_lock<mutex> l(lock, defer_lock);
+                                    if (gc.shared) l.lock();
+                                    node *v = map_of(m)->find(k);
+                                    if (builtin == node::HAS) return node(v != NULL);
+                                    if (v != NULL) return *v;
+                                }
+                                return n.v_list().size() > 3 ? eval(n.v_list()[3], env) : node();}
+                            case node::PUT: // (put MAP KEY VALUE) => MAP, with KEY set to VALUE in place
+                            case node::REMOVE: { // (remove MAP KEY) => MAP, without KEY
+                                node m = eval(n.v_list().at(1), env);
+                                node k = eval(n.v_list().at(2), env);
+                                node v = builtin == node::PUT ? eval(n.v_list().at(3), env) : node();
+                                if (!map_args(*this, m, k)) return node();
+                                unique_lock<mutex> l(lock, defer_lock);
+                                if (gc.shared) l.lock();
+                                if (builtin == node::PUT) map_of(m)->put(k) = v; else map_of(m)->remove(k);
+                                return m;}
+                            case node::KEYS: // (keys MAP) => its keys as a list, in no order
+                            case node::VALS: { // (vals MAP) => its values, in the order of the keys
+                                node m = eval(n.v_list().at(1), env);
+                                if (m.type != node::T_MAP) {
+                                    *err << "Not a map: " << m.str_with_type() << endl;
+                                    return node();
+                                }
+                                vector<node> ret;
+                                gc_root root(gc, ret);
+                                {
+                                    unique_lock<mutex> l(lock, defer_lock);
+                                    if (gc.shared) l.lock();
+                                    map_object *o = map_of(m);
+                                    for (size_t i = 0; i < o->slots.size(); i++) {
+                                        if (o->ctrl[i] >= 0) ret.push_back(builtin == node::KEYS ? o->slots[i].key : o->slots[i].value);
                                     }
-                                    else {
-                                        for (; a >= last; a += step) {
-                                            for (int i = 5; i < len; i++) {
-                                                eval(n.v_list[i], env);
-                                            }
-                                        }
+                                }
+                                return node(ret);}
+                            case node::BEGIN: { // (begin X ..)
+                                int last = n.v_list().size() - 1;
+                                if (last <= 0) return node();
+                                for (int i = 1; i < last; i++) {
+                                    eval(n.v_list()[i], env);
+                                }
+                                tail = &n.v_list()[last];
+                                continue;}
+                            case node::PR: // (pr X ..)
+                            case node::PRN: // (prn X ..)
+                                {
+                                    auto first = n.v_list().begin() + 1;
+                                    for (auto i = first; i != n.v_list().end(); i++) {
+                                        node x = eval(*i, env);
+                                        print(*this, i != first ? " " : "", x);
                                     }
+                                    end_print(*this, builtin == node::PRN);
+                                    return node();
                                 }
-                                return node();
-                            }
-                        case node::WHILE: { // (while CONDITION EXPR ..)
-                            node &cond = n.v_list[1];
-                            int len = n.v_list.size();
-                            while (eval(cond, env).v_bool) {
-                                for (int i = 2; i < len; i++) {
-                                    eval(n.v_list[i], env);
+                            case node::EXIT: { // (exit X)
+                                    flush();
+                                    *out << endl;
+                                    exit(eval(n.v_list()[1], env).to_int());
+                                    return node(); }
+                            case node::SYSTEM: { // Invokes the command processor to execute a command.
+                                string cmd;
+                                for (unsigned int i = 1; i < n.v_list().size(); i++) {
+                                    if (i != 1) cmd += ' ';
+                                    node x = eval(n.v_list()[i], env);
+                                    if (x.type == node::T_STRING) cmd += str_of(x)->view(); else cmd += x.v_string();
                                 }
+                                flush();
+                                out->flush(); // before the output of the command
+                                return node(system(cmd.c_str()));}
+                            default: {
+                                *err << "Not implemented function: [" << func.v_string() << "]" << endl;
+                                return node();}
+                        } // end switch
+                    }
+                    else {
+                        list_object &f = func.v_list();
+                        if (func.type == node::T_FN) {
+                            // anonymous function application. lexical scoping
+                            // (fn (ARGUMENT ..) BODY ..)
+                            int alen = f[1].v_list().size();
+                            node small[8]; // arguments, evaluated before the frame of a tail call is replaced
+                            vector<node> large;
+                            node *args = small;
+                            if (alen > 8) {
+                                large.resize(alen);
+                                args = &large[0];
+                                if (!heap::worker()) gc.roots.push_back(&large);
                             }
-                            return node(); }
-                        case node::STRLEN: { // (strlen X)
-                            return node((int) eval(n.v_list[1], env).v_string.size());}
-                        case node::STRCAT: { // (strcat X ..)
-                            int len = n.v_list.size();
-                            if (len <= 1) return node("");
-                            node first = eval(n.v_list[1], env);
-                            string acc = first.to_str();
-                            for (auto i = n.v_list.begin() + 2; i != n.v_list.end(); i++) {
-                                acc += eval(*i, env).to_str();
-                            }
-                            return node(acc);}
-                        case node::CHAR_AT: { // (char-at X)
-                            return node(eval(n.v_list[1], env).v_string[eval(n.v_list[2], env).v_int]);}
-                        case node::CHR: { // (chr X)
-                            char temp[2] = " ";
-                            temp[0] = (char) eval(n.v_list[1], env).v_int;
-                            return node(string(temp));}
-                        case node::STRING: { // (string X)
-                            return node(eval(n.v_list[1], env).to_str());}
-                        case node::DOUBLE: { // (double X)
-                            return node(eval(n.v_list[1], env).to_double());}
-                        case node::INT: { // (int X)
-                            return node(eval(n.v_list[1], env).to_int());}
-                        case node::READ_STRING: { // (read-string X)
-                            return node(parse(eval(n.v_list[1], env).to_str())[0]);}
-                        case node::TYPE: { // (type X)
-                            return node(eval(n.v_list[1], env).type_str());}
-                        case node::EVAL: { // (eval X)
-                            node n2 = eval(n.v_list[1], env);
-                            return node(eval(n2, env));}
-                        case node::QUOTE: { // (quote X)
-                            return n.v_list[1];}
-                        case node::FN: { // (fn (ARGUMENT ..) BODY) => lexical closure
-                            node n2 = fn(n.v_list, &env);
-                            return n2;}
-                        case node::LIST: { // (list X ..)
-                            vector<node> ret;
-                            for (unsigned int i = 1; i < n.v_list.size(); i++) {
-                                ret.push_back(eval(n.v_list[i], env));
-                            }
-                            return node(ret);}
-                        case node::APPLY: { // (apply FUNC LIST)
-                            vector<node> expr;
-                            node f = eval(n.v_list[1], env);
-                            expr.push_back(f);
-                            vector<node> lst = eval(n.v_list[2], env).v_list;
-                            for (unsigned int i = 0; i < lst.size(); i++) {
-                                expr.push_back(lst.at(i));
-                            }
-                            node n2 = node(expr);
-                            return eval(n2, env);
-                        }
-                        case node::MAP: { // (map FUNC LIST)
-                            node f = eval(n.v_list.at(1), env);
-                            vector<node> lst = eval(n.v_list.at(2), env).v_list;
-                            vector<node> acc;
-                            vector<node> expr; // (FUNC ITEM)
-                            expr.push_back(f);
-                            expr.push_back(node());
-                            for (unsigned int i = 0; i < lst.size(); i++) {
-                                expr[1] = lst.at(i);
-                                node n2 = node(expr);
-                                acc.push_back(eval(n2, env));
+                            for (int i=0; i<alen; i++) { // assign arguments
+                                args[i] = eval(n.v_list().at(i + 1), env);
                             }
-                            return node(acc);
-                        }
-                        case node::FILTER: { // (filter FUNC LIST)
-                            node f = eval(n.v_list.at(1), env);
-                            vector<node> lst = eval(n.v_list.at(2), env).v_list;
-                            vector<node> acc;
-                            vector<node> expr; // (FUNC ITEM)
-                            expr.push_back(f);
-                            expr.push_back(node());
-                            for (unsigned int i = 0; i < lst.size(); i++) {
-                                node item = lst.at(i);
-                                expr[1] = item;
-                                node n2 = node(expr);
-                                node ret = eval(n2, env);
-                                if (ret.v_bool) acc.push_back(item);
+                            if (profiling != NULL && !heap::worker()) frame.profile_fn(func, env);
+                            frame.enter(func, args, alen);
+                            if (alen > 8 && !heap::worker()) gc.roots.pop_back();
+
+                            int flen = f.size();
+                            for (int i=2; i<flen-1; i++) { // body
+                                eval(f.at(i), *frame.env);
                             }
-                            return node(acc);
+                            tail = &f.at(flen-1); // proper tail call: the loop reuses this eval and frame
+                            tail_env = frame.env;
+                            continue;
                         }
-                        case node::RANGE: { // (range START END STEP)
-                            node start = eval(n.v_list.at(1), env);
-                            vector<node> ret;
-                            if (start.type == node::T_INT) {
-                                int a = eval(n.v_list.at(1), env).v_int;
-                                int last = eval(n.v_list.at(2), env).v_int;
-                                int step = eval(n.v_list.at(3), env).v_int;
-                                if (step >= 0) {
-                                    for (; a <= last; a += step) {
-                                        ret.push_back(node(a));}}
-                                else {
-                                    for (; a >= last; a += step) {
-                                        ret.push_back(node(a));}}
-                            }
-                            else {
-                                double a = eval(n.v_list.at(1), env).v_double;
-                                double last = eval(n.v_list.at(2), env).v_double;
-                                double step = eval(n.v_list.at(3), env).v_double;
-                                if (step >= 0) {
-                                    for (; a <= last; a += step) {
-                                        ret.push_back(node(a));}}
-                                else {
-                                    for (; a >= last; a += step) {
-                                        ret.push_back(node(a));}}
-                            }
-                            return node(ret);
+                        else {
+                            *err << "Unknown function: [" << func.to_str() << "]" << endl;
+                            return node();
                         }
-                        case node::NTH: { // (nth INDEX LIST)
-                            int i = eval(n.v_list.at(1), env).v_int;
-                            const vector<node> &lst = eval(n.v_list.at(2), env).v_list;
-                            return lst.at(i);}
-                        case node::LENGTH: { // (length LIST)
-                            const vector<node> &lst = eval(n.v_list.at(1), env).v_list;
-                            return node((int) lst.size());}
-                        case node::BEGIN: { // (begin X ..)
-                            int last = n.v_list.size() - 1;
-                            if (last <= 0) return node();
-                            for (int i = 1; i < last; i++) {
-                                eval(n.v_list[i], env);
-                            }
-                            return eval(n.v_list[last], env);}
-                        case node::PR: // (pr X ..)
-                            {
-                                auto first = n.v_list.begin() + 1;
-                                for (auto i = first; i != n.v_list.end(); i++) {
-                                    if (i != first) printf(" ");
-                                    printf("%s", eval(*i, env).to_str().c_str());
-                                }
-                                return node();
-                            }
-                        case node::PRN: // (prn X ..)
-                            {
-                                auto first = n.v_list.begin() + 1;
-                                for (auto i = first; i != n.v_list.end(); i++) {
-                                    if (i != first) printf(" ");
-                                    printf("%s", eval(*i, env).to_str().c_str());
-                                }
-                                puts("");
-                                return node();
-                            }
-                        case node::EXIT: { // (exit X)
-                                puts("");
-                                exit(eval(n.v_list[1], env).to_int());
-                                return node(); }
-                        case node::SYSTEM: { // Invokes the command processor to execute a command.
-                            string cmd;
-                            for (unsigned int i = 1; i < n.v_list.size(); i++) {
-                                if (i != 1) cmd += ' ';
-                                cmd += eval(n.v_list[i], env).v_string;
-                            }
-                            return node(system(cmd.c_str()));}
-                        default: {
-                            cerr << "Not implemented function: [" << func.v_string << "]" << endl;
-                            return node();}
-                    } // end switch
+                    }
                 }
-                else {
-                    vector<node> &f = func.v_list;
-                    if (func.type == node::T_FN) {
-                        // anonymous function application. lexical scoping
-                        // (fn (ARGUMENT ..) BODY ..)
-                        vector<node> &arg_syms = f[1].v_list;
-
-                        environment *local_env = (environment *)func.env.get();
-                        int alen = arg_syms.size();
-                        for (int i=0; i<alen; i++) { // assign arguments
-                            string &k = arg_syms.at(i).v_string;
-                            local_env->env[k] = eval(n.v_list.at(i + 1), env);
-                        }
+            default:
+                *err << "Unknown type" << endl;
+                return node();
+            }
+        } // end while
+    }
 
-                        int flen = f.size();
-                        for (int i=2; i<flen-1; i++) { // body
-                            eval(f.at(i), *local_env);
-                        }
-                        node ret = eval(f.at(flen-1), *local_env);
-                        return ret;
-                    }
-                    else {
-                        cerr << "Unknown function: [" << func.to_str() << "]" << endl;
-                        return node();
+    // rewrites code before it runs: calls of pure builtins on constants become their values, if and when
+    // with a constant condition become the branch taken, (^ X 2) becomes (* 1.0 X X), and E, PI, true and
+    // false become their values. a name keeps its meaning if the code binds it anywhere (set, for, ++, --
+    // or an argument) or it is bound as a variable; code that calls eval or read-string is left alone
+    class optimizer {
+    private:
+        paren &p;
+        vector<bool> bound; // by symbol ID
+        int id_set, id_for, id_fn, id_inc, id_dec, id_eval, id_read;
+        vector<int> constants; // IDs of E, PI, true and false
+
+        void bind(const node &n) {
+            if (n.type == node::T_SYMBOL) bound[n.v_int] = true;
+        }
+        bool scan(const node &n) { // marks the names n binds. false if n may run data as code
+            if (n.type == node::T_SYMBOL) return n.v_int != id_eval && n.v_int != id_read;
+            if (n.type != node::T_LIST) return true;
+            list_object &v = n.v_list();
+            if (v.size() >= 2 && v[0].type == node::T_SYMBOL) {
+                int head = v[0].v_int;
+                if (head == id_set || head == id_for || head == id_inc || head == id_dec) bind(v[1]);
+                if (head == id_fn && v[1].type == node::T_LIST) {
+                    for (size_t i = 0; i < v[1].v_list().size(); i++) bind(v[1].v_list()[i]);
+                }
+            }
+            for (size_t i = 0; i < v.size(); i++) {
+                if (!scan(v[i])) return false;
+            }
+            return true;
+        }
+        bool free(int id) { // if id still means what init gave it
+            if (bound[id]) return false;
+            node *v = p.global_env.find(id);
+            return v == NULL || v->type == node::T_NIL;
+        }
+        int builtin_of(const node &head) {
+            if (head.type == node::T_BUILTIN) return generic(head.v_int);
+            if (head.type != node::T_SYMBOL || !free(head.v_int)) return -1;
+            return head.v_int < (int) p.builtin_ids.size() ? p.builtin_ids[head.v_int] : -1;
+        }
+        static bool number(const node &n) {return n.type == node::T_INT || n.type == node::T_DOUBLE;}
+        static bool literal(const node &n) {return number(n) || n.type == node::T_BOOL || n.type == node::T_STRING;}
+        bool foldable(int b, list_object &v) { // if (b ARG ..) has a value that does not depend on when it runs
+            size_t len = v.size();
+            for (size_t i = 1; i < len; i++) {
+                if (!literal(v[i])) return false;
+            }
+            bool numbers = true, bools = true;
+            for (size_t i = 1; i < len; i++) {
+                numbers = numbers && number(v[i]);
+                bools = bools && v[i].type == node::T_BOOL;
+            }
+            switch (b) {
+            case node::PLUS: case node::MINUS: case node::MUL:
+            case node::EQEQ: case node::NOTEQ:
+                return len >= 2 && numbers;
+            case node::DIV:
+                if (len < 2 || !numbers) return false;
+                if (v[1].type == node::T_INT) {
+                    for (size_t i = 2; i < len; i++) {
+                        int d = v[i].to_int();
+                        if (d == 0 || d == -1) return false; // traps, or may overflow
                     }
                 }
+                return true;
+            case node::PERCENT: {
+                if (len != 3 || !numbers) return false;
+                int d = v[2].to_int();
+                return d != 0 && d != -1;}
+            case node::CARET: case node::LT: case node::GT: case node::LTE: case node::GTE:
+                return len == 3 && numbers;
+            case node::SQRT: case node::INC: case node::DEC: case node::FLOOR: case node::CEIL:
+            case node::LN: case node::LOG10: case node::INT: case node::DOUBLE:
+                return len == 2 && numbers;
+            case node::ANDAND: case node::OROR:
+                return bools;
+            case node::NOT:
+                return len == 2 && bools;
+            case node::STRLEN:
+                return len == 2 && v[1].type == node::T_STRING;
+            case node::STRCAT:
+                return len >= 2;
+            case node::CHAR_AT:
+                return len == 3 && v[1].type == node::T_STRING && v[2].type == node::T_INT
+                    && v[2].v_int >= 0 && v[2].v_int < (int) str_of(v[1])->size();
+            case node::CHR:
+                return len == 2 && v[1].type == node::T_INT;
+            case node::STRING: case node::TYPE:
+                return len == 2;
+            default:
+                return false;
             }
-        default:
-            cerr << "Unknown type" << endl;
-            return node();
         }
+        static node form(int b, vector<node> args) { // (b ARG ..), whatever the name of b is bound to
+            node head(node::T_BUILTIN, NULL);
+            head.v_int = b;
+            args.insert(args.begin(), head);
+            return node(args);
+        }
+    public:
+        optimizer(paren &p): p(p) {
+            id_set = p.symbols.intern("set");
+            id_for = p.symbols.intern("for");
+            id_fn = p.symbols.intern("fn");
+            id_inc = p.symbols.intern("++");
+            id_dec = p.symbols.intern("--");
+            id_eval = p.symbols.intern("eval");
+            id_read = p.symbols.intern("read-string");
+            const char *names[] = {"E", "PI", "true", "false"};
+            for (int i = 0; i < 4; i++) constants.push_back(p.symbols.intern(names[i]));
+        }
+        bool prepare(vector<node> &code) { // false if the code must be left alone
+            bound.assign(p.symbols.names.size(), false);
+            for (size_t i = 0; i < code.size(); i++) {
+                if (!scan(code[i])) return false;
+            }
+            return true;
+        }
+        node optimize(const node &n) {
+            if (n.type == node::T_SYMBOL) {
+                for (size_t i = 0; i < constants.size(); i++) {
+                    if (n.v_int != constants[i] || bound[n.v_int]) continue;
+                    node *v = p.global_env.find(n.v_int);
+                    if (v != NULL && (number(*v) || v->type == node::T_BOOL)) return *v;
+                }
+                return n;
+            }
+            if (n.type != node::T_LIST || n.v_list().empty()) return n;
+            list_object &v = n.v_list();
+            int b = builtin_of(v[0]);
+            size_t from = 1; // first item that is code
+            switch (b) {
+            case node::QUOTE: return n;
+            case node::FN: from = 2; break; // past the arguments
+            case node::SET: case node::FOR: case node::PLUSPLUS: case node::MINUSMINUS: from = 2; break; // past the variable
+            }
+            if (b < 0) from = 0;
+            for (size_t i = from; i < v.size(); i++) v[i] = optimize(v[i]);
+
+            switch (b) {
+            case node::IF: // (if CONDITION THEN_EXPR ELSE_EXPR)
+                if (v.size() == 4 && v[1].type == node::T_BOOL) return v[1].v_bool ? v[2] : v[3];
+                return n;
+            case node::WHEN: // (when CONDITION EXPR ..)
+                if (v.size() < 3 || v[1].type != node::T_BOOL) return n;
+                if (!v[1].v_bool) return node();
+                if (v.size() == 3) return v[2];
+                return form(node::BEGIN, vector<node>(v.begin() + 2, v.end()));
+            case node::CARET: // (^ X 2) => (* 1.0 X X). pow rounds the same as one multiplication
+                if (v.size() == 3 && v[1].type == node::T_SYMBOL && number(v[2]) && v[2].to_double() == 2.0) {
+                    node args[] = {node(1.0), v[1], v[1]};
+                    return form(node::MUL, vector<node>(args, args + 3));
+                }
+                break;
+            }
+            if (b >= 0 && foldable(b, v)) {
+                ostringstream errors;
+                ostream *saved = p.err;
+                p.err = &errors;
+                node call = n;
+                node value = p.eval(call, p.global_env);
+                p.err = saved;
+                if (errors.str().empty() && literal(value)) return value;
+            }
+            return n;
+        }
+    };
+
+    void paren::optimize(vector<node> &code) {
+        paren_scope ps(*this);
+        gc_root root(gc, code);
+        optimizer o(*this);
+        if (!o.prepare(code)) return;
+        for (size_t i = 0; i < code.size(); i++) code[i] = o.optimize(code[i]);
     }
 
     node paren::eval_all(vector<node> &lst) {
+        paren_scope ps(*this);
+        gc_root root(gc, lst);
+        if (opt) optimize(lst);
         int last = lst.size() - 1;
         if (last < 0) return node();
+        if (vm) {
+            for (int i = 0; i < last; i++) {
+                chunk c = compile(lst[i]);
+                run(c, global_env);
+            }
+            chunk c = compile(lst[last]);
+            node result = run(c, global_env);
+            flush();
+            return result;
+        }
         for (int i = 0; i < last; i++) {
             eval(lst[i], global_env);
         }
-        return eval(lst[last], global_env);
+        node result = eval(lst[last], global_env);
+        flush();
+        return result;
+    }
+
+    void paren::flush() {
+        if (out_buffer.empty()) return;
+        out->write(out_buffer.data(), out_buffer.size());
+        out_buffer.clear();
+    }
+
+    // bytecode instructions. operands follow the opcode in chunk::code
+    enum opcode {
+        OP_CONST, // k: push consts[k]
+        OP_NIL, // push nil
+        OP_POP, // discard top
+        OP_LOAD, // k: push value of symbol consts[k]
+        OP_STORE, // k: pop into symbol consts[k] of the current environment
+        OP_JMP, // a: jump to a
+        OP_JMPF, // a: pop, jump to a if false
+        OP_JMPT, // a: pop, jump to a if true
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_POW, // binary arithmetic. the left operand decides the type
+        OP_EQ, OP_NE, OP_LT, OP_GT, OP_LTE, OP_GTE, OP_NOT,
+        OP_INC, OP_DEC,
+        OP_INCVAR, OP_DECVAR, // k: ++ or -- symbol consts[k], push nil
+        OP_FORPREP, // k a: stack is (LAST STEP). enter the loop over symbol consts[k] or jump to a
+        OP_FORLOOP, // k a: step symbol consts[k], jump back to a while in range
+        OP_STRLEN, OP_CHARAT, OP_STRING,
+        OP_CALL, // n: stack is (FUNC ARGUMENT ..) with n arguments
+        OP_EVAL, // k: evaluate consts[k] with the tree-walking evaluator
+        OP_RET,
+        OP_COUNT
+    };
+
+    class compiler {
+    private:
+        paren &p;
+        chunk &c;
+        int depth; // current stack depth
+
+        void emit(int op) {
+            c.code.push_back(op);
+        }
+        void emit(int op, int a) {
+            c.code.push_back(op); c.code.push_back(a);
+        }
+        void push(int k) { // track stack depth
+            depth += k;
+            if (depth > c.max_stack) c.max_stack = depth;
+        }
+        int konst(const node &n) {
+            c.consts.push_back(n);
+            return c.consts.size() - 1;
+        }
+        int jump(int op) { // emit a jump with a placeholder target, returns the operand position
+            emit(op, 0);
+            return c.code.size() - 1;
+        }
+        void patch(int at) {
+            c.code[at] = c.code.size();
+        }
+        void fallback(node &n) {
+            emit(OP_EVAL, konst(n)); push(1);
+        }
+        void body(list_object &v, int from) { // evaluate v[from..] for side effects
+            for (unsigned int i = from; i < v.size(); i++) {
+                expr(v[i]); emit(OP_POP); push(-1);
+            }
+        }
+        void binary(list_object &v, int op) { // left fold
+            expr(v[1]);
+            for (unsigned int i = 2; i < v.size(); i++) {
+                expr(v[i]); emit(op); push(-1);
+            }
+        }
+        int head_builtin(node &head) { // builtin called by head, or -1
+            if (head.type == node::T_BUILTIN) return generic(head.v_int);
+            if (head.type != node::T_SYMBOL) return -1;
+            node *v = p.global_env.find(head.v_int);
+            if (v != NULL && v->type != node::T_NIL) return -1;
+            return head.v_int < (int) p.builtin_ids.size() ? p.builtin_ids[head.v_int] : -1;
+        }
+    public:
+        compiler(paren &p, chunk &c): p(p), c(c), depth(0) {}
+
+        void expr(node &n) {
+            switch (n.type) {
+            case node::T_SYMBOL:
+                emit(OP_LOAD, konst(n)); push(1);
+                return;
+            case node::T_LIST:
+                break;
+            case node::T_LOCAL:
+                fallback(n);
+                return;
+            default:
+                emit(OP_CONST, konst(n)); push(1);
+                return;
+            }
+            list_object &v = n.v_list();
+            int len = v.size();
+            if (len == 0) {emit(OP_NIL); push(1); return;}
+            switch (head_builtin(v[0])) {
+            case -1: { // (FUNCTION ARGUMENT ..)
+                for (int i = 0; i < len; i++) expr(v[i]);
+                emit(OP_CALL, len - 1); push(-(len - 1));
+                return;}
+            case node::PLUS:
+                if (len >= 3) {binary(v, OP_ADD); return;} break;
+            case node::MINUS:
+                if (len >= 3) {binary(v, OP_SUB); return;} break;
+            case node::MUL:
+                if (len >= 3) {binary(v, OP_MUL); return;} break;
+            case node::DIV:
+                if (len >= 3) {binary(v, OP_DIV); return;} break;
+            case node::PERCENT:
+                if (len == 3) {binary(v, OP_MOD); return;} break;
+            case node::CARET:
+                if (len == 3) {binary(v, OP_POW); return;} break;
+            case node::EQEQ:
+                if (len == 3) {binary(v, OP_EQ); return;} break;
+            case node::NOTEQ:
+                if (len == 3) {binary(v, OP_NE); return;} break;
+            case node::LT:
+                if (len == 3) {binary(v, OP_LT); return;} break;
+            case node::GT:
+                if (len == 3) {binary(v, OP_GT); return;} break;
+            case node::LTE:
+                if (len == 3) {binary(v, OP_LTE); return;} break;
+            case node::GTE:
+                if (len == 3) {binary(v, OP_GTE); return;} break;
+            case node::NOT:
+                if (len == 2) {expr(v[1]); emit(OP_NOT); return;} break;
+            case node::INC:
+                if (len == 2) {expr(v[1]); emit(OP_INC); return;} break;
+            case node::DEC:
+                if (len == 2) {expr(v[1]); emit(OP_DEC); return;} break;
+            case node::STRLEN:
+                if (len == 2) {expr(v[1]); emit(OP_STRLEN); return;} break;
+            case node::STRING:
+                if (len == 2) {expr(v[1]); emit(OP_STRING); return;} break;
+            case node::CHAR_AT:
+                if (len == 3) {binary(v, OP_CHARAT); return;} break;
+            case node::PLUSPLUS:
+                if (len == 2 && v[1].type == node::T_SYMBOL) {emit(OP_INCVAR, konst(v[1])); push(1); return;} break;
+            case node::MINUSMINUS:
+                if (len == 2 && v[1].type == node::T_SYMBOL) {emit(OP_DECVAR, konst(v[1])); push(1); return;} break;
+            case node::QUOTE:
+                if (len >= 2) {emit(OP_CONST, konst(v[1])); push(1); return;} break;
+            case node::SET: // (set SYMBOL VALUE)
+                if (len == 3) {
+                    expr(v[2]);
+                    emit(OP_STORE, konst(v[1])); push(-1);
+                    emit(OP_NIL); push(1);
+                    return;
+                }
+                break;
+            case node::ANDAND: // (&& X ..)
+            case node::OROR: { // (|| X ..)
+                bool is_and = head_builtin(v[0]) == node::ANDAND;
+                vector<int> exits;
+                for (int i = 1; i < len; i++) {
+                    expr(v[i]); push(-1);
+                    exits.push_back(jump(is_and ? OP_JMPF : OP_JMPT));
+                }
+                emit(OP_CONST, konst(node(is_and)));
+                int end = jump(OP_JMP);
+                for (unsigned int i = 0; i < exits.size(); i++) patch(exits[i]);
+                emit(OP_CONST, konst(node(!is_and)));
+                patch(end);
+                push(1);
+                return;}
+            case node::IF: // (if CONDITION THEN_EXPR ELSE_EXPR)
+                if (len == 4) {
+                    expr(v[1]); push(-1);
+                    int to_else = jump(OP_JMPF);
+                    expr(v[2]); push(-1);
+                    int end = jump(OP_JMP);
+                    patch(to_else);
+                    expr(v[3]);
+                    patch(end);
+                    return;
+                }
+                break;
+            case node::WHEN: // (when CONDITION EXPR ..)
+                if (len >= 3) {
+                    expr(v[1]); push(-1);
+                    int to_nil = jump(OP_JMPF);
+                    for (int i = 2; i < len - 1; i++) {
+                        expr(v[i]); emit(OP_POP); push(-1);
+                    }
+                    expr(v[len - 1]); push(-1);
+                    int end = jump(OP_JMP);
+                    patch(to_nil);
+                    emit(OP_NIL); push(1);
+                    patch(end);
+                    return;
+                }
+                break;
+            case node::WHILE: { // (while CONDITION EXPR ..)
+                if (len < 2) break;
+                int top = c.code.size();
+                expr(v[1]); push(-1);
+                int exit = jump(OP_JMPF);
+                body(v, 2);
+                emit(OP_JMP, top);
+                patch(exit);
+                emit(OP_NIL); push(1);
+                return;}
+            case node::FOR: { // (for SYMBOL START END STEP EXPR ..)
+                if (len < 5 || v[1].type != node::T_SYMBOL) break;
+                int k = konst(v[1]);
+                expr(v[2]);
+                emit(OP_STORE, k); push(-1);
+                expr(v[3]);
+                expr(v[4]);
+                emit(OP_FORPREP, k);
+                int exit = c.code.size(); emit(0);
+                int top = c.code.size();
+                body(v, 5);
+                emit(OP_FORLOOP, k); emit(top);
+                patch(exit);
+                emit(OP_POP); emit(OP_POP); push(-2);
+                emit(OP_NIL); push(1);
+                return;}
+            case node::BEGIN: // (begin X ..)
+                if (len == 1) {emit(OP_NIL); push(1); return;}
+                for (int i = 1; i < len - 1; i++) {
+                    expr(v[i]); emit(OP_POP); push(-1);
+                }
+                expr(v[len - 1]);
+                return;
+            }
+            fallback(n);
+        }
+
+        void compile(node &n) {
+            expr(n);
+            emit(OP_RET);
+        }
+    };
+
+    chunk paren::compile(node &n) {
+        chunk c;
+        compiler(*this, c).compile(n);
+        return c;
+    }
+
+    node paren::run(chunk &c, environment &env) {
+        paren_scope ps(*this);
+        vector<node> stack(c.max_stack + 1);
+        gc_root root1(gc, stack), root2(gc, c.consts);
+        node *sp = &stack[0]; // next free slot
+        const int *code = &c.code[0];
+        const int *ip = code;
+        node *consts = c.consts.empty() ? NULL : &c.consts[0];
+
+#if defined(__GNUC__)
+        static void *labels[OP_COUNT] = {
+            &&L_OP_CONST, &&L_OP_NIL, &&L_OP_POP, &&L_OP_LOAD, &&L_OP_STORE,
+            &&L_OP_JMP, &&L_OP_JMPF, &&L_OP_JMPT,
+            &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD, &&L_OP_POW,
+            &&L_OP_EQ, &&L_OP_NE, &&L_OP_LT, &&L_OP_GT, &&L_OP_LTE, &&L_OP_GTE, &&L_OP_NOT,
+            &&L_OP_INC, &&L_OP_DEC, &&L_OP_INCVAR, &&L_OP_DECVAR,
+            &&L_OP_FORPREP, &&L_OP_FORLOOP,
+            &&L_OP_STRLEN, &&L_OP_CHARAT, &&L_OP_STRING,
+            &&L_OP_CALL, &&L_OP_EVAL, &&L_OP_RET};
+#define VM_CASE(op) L_##op:
+#define VM_NEXT goto *labels[*ip++]
+        VM_NEXT;
+        {
+#else // portable switch dispatch
+#define VM_CASE(op) case op:
+#define VM_NEXT continue
+        while (true) {
+            switch (*ip++) {
+#endif
+            VM_CASE(OP_CONST) {
+                *sp++ = consts[*ip++];
+                VM_NEXT;}
+            VM_CASE(OP_NIL) {
+                *sp++ = node();
+                VM_NEXT;}
+            VM_CASE(OP_POP) {
+                sp--;
+                VM_NEXT;}
+            VM_CASE(OP_LOAD) {
+                node &sym = consts[*ip++];
+                node *v = env.find(sym.v_int);
+                *sp++ = v != NULL && v->type != node::T_NIL ? *v : eval(sym, env); // builtin or unknown variable
+                VM_NEXT;}
+            VM_CASE(OP_STORE) {
+                env.env[consts[*ip++].v_int] = *--sp;
+                VM_NEXT;}
+            VM_CASE(OP_JMP) {
+                ip = code + *ip;
+                VM_NEXT;}
+            VM_CASE(OP_JMPF) {
+                if (!(--sp)->v_bool) ip = code + *ip; else ip++;
+                VM_NEXT;}
+            VM_CASE(OP_JMPT) {
+                if ((--sp)->v_bool) ip = code + *ip; else ip++;
+                VM_NEXT;}
+#define VM_ARITH(op, OPER, BUILTIN) \
+            VM_CASE(op) { \
+                node &b = *--sp; node &a = sp[-1]; \
+                if (a.type == node::T_INT && b.type != node::T_VEC) a.v_int = a.v_int OPER b.to_int(); \
+                else if (a.type == node::T_DOUBLE && b.type != node::T_VEC) a.v_double = a.v_double OPER b.to_double(); \
+                else a = binary(*this, BUILTIN, a, b); \
+                VM_NEXT;}
+            VM_ARITH(OP_ADD, +, node::PLUS)
+            VM_ARITH(OP_SUB, -, node::MINUS)
+            VM_ARITH(OP_MUL, *, node::MUL)
+            VM_ARITH(OP_DIV, /, node::DIV)
+            VM_CASE(OP_MOD) {
+                node &b = *--sp; node &a = sp[-1];
+                if (a.type == node::T_INT) a.v_int %= b.to_int();
+                else a = node(a.to_int() % b.to_int());
+                VM_NEXT;}
+            VM_CASE(OP_POW) {
+                node &b = *--sp; node &a = sp[-1];
+                a = node(pow(a.to_double(), b.to_double()));
+                VM_NEXT;}
+#define VM_COMPARE(op, OPER, BUILTIN) \
+            VM_CASE(op) { \
+                node &b = *--sp; node &a = sp[-1]; \
+                if (a.type == node::T_VEC || b.type == node::T_VEC) {a = binary(*this, BUILTIN, a, b); VM_NEXT;} \
+                bool r = a.type == node::T_INT ? a.v_int OPER b.to_int() : a.v_double OPER b.to_double(); \
+                if (a.type == node::T_INT || a.type == node::T_DOUBLE) {a.type = node::T_BOOL; a.v_bool = r;} \
+                else a = node(r); \
+                VM_NEXT;}
+            VM_COMPARE(OP_EQ, ==, node::EQEQ)
+            VM_COMPARE(OP_NE, !=, node::NOTEQ)
+            VM_COMPARE(OP_LT, <, node::LT)
+            VM_COMPARE(OP_GT, >, node::GT)
+            VM_COMPARE(OP_LTE, <=, node::LTE)
+            VM_COMPARE(OP_GTE, >=, node::GTE)
+            VM_CASE(OP_NOT) {
+                sp[-1] = node(!sp[-1].v_bool);
+                VM_NEXT;}
+            VM_CASE(OP_INC) {
+                node &a = sp[-1];
+                if (a.type == node::T_INT) a.v_int++; else a = node(a.v_double + 1.0);
+                VM_NEXT;}
+            VM_CASE(OP_DEC) {
+                node &a = sp[-1];
+                if (a.type == node::T_INT) a.v_int--; else a = node(a.v_double - 1.0);
+                VM_NEXT;}
+            VM_CASE(OP_INCVAR) {
+                node *a = env.find(consts[*ip++].v_int);
+                if (a != NULL) {
+                    if (a->type == node::T_INT) a->v_int++; else a->v_double++;
+                }
+                *sp++ = node();
+                VM_NEXT;}
+            VM_CASE(OP_DECVAR) {
+                node *a = env.find(consts[*ip++].v_int);
+                if (a != NULL) {
+                    if (a->type == node::T_INT) a->v_int--; else a->v_double--;
+                }
+                *sp++ = node();
+                VM_NEXT;}
+            VM_CASE(OP_FORPREP) {
+                node &a = env.define(consts[*ip++].v_int); // stored by the OP_STORE before
+                node &last = sp[-2], &step = sp[-1];
+                bool in_range;
+                if (a.type == node::T_INT) {
+                    last = node(last.to_int()); step = node(step.to_int());
+                    in_range = step.v_int >= 0 ? a.v_int <= last.v_int : a.v_int >= last.v_int;
+                }
+                else {
+                    last = node(last.to_double()); step = node(step.to_double());
+                    in_range = step.v_double >= 0 ? a.v_double <= last.v_double : a.v_double >= last.v_double;
+                }
+                if (in_range) ip++; else ip = code + *ip;
+                VM_NEXT;}
+            VM_CASE(OP_FORLOOP) {
+                node &a = env.define(consts[*ip++].v_int); // stored by the OP_STORE before
+                node &last = sp[-2], &step = sp[-1];
+                bool in_range;
+                if (last.type == node::T_INT) {
+                    a.v_int += step.v_int;
+                    in_range = step.v_int >= 0 ? a.v_int <= last.v_int : a.v_int >= last.v_int;
+                }
+                else {
+                    a.v_double += step.v_double;
+                    in_range = step.v_double >= 0 ? a.v_double <= last.v_double : a.v_double >= last.v_double;
+                }
+                if (in_range) ip = code + *ip; else ip++;
+                VM_NEXT;}
+            VM_CASE(OP_STRLEN) {
+                sp[-1] = node(sp[-1].type == node::T_STRING ? (int) str_of(sp[-1])->size() : 0);
+                VM_NEXT;}
+            VM_CASE(OP_CHARAT) {
+                node &b = *--sp; node &a = sp[-1];
+                a = node(a.type == node::T_STRING ? (int) str_of(a)->view()[b.v_int] : 0);
+                VM_NEXT;}
+            VM_CASE(OP_STRING) {
+                sp[-1] = node(sp[-1].to_str());
+                VM_NEXT;}
+            VM_CASE(OP_CALL) {
+                int argc = *ip++;
+                node *args = sp - argc;
+                args[-1] = call(args[-1], args, argc, env);
+                sp = args;
+                VM_NEXT;}
+            VM_CASE(OP_EVAL) {
+                *sp++ = eval(consts[*ip++], env);
+                VM_NEXT;}
+            VM_CASE(OP_RET) {
+                return sp[-1];}
+#if !defined(__GNUC__)
+            default:
+                *err << "Invalid opcode" << endl;
+                return node();
+            } // end switch
+#endif
+        }
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_ARITH
+#undef VM_COMPARE
     }
 
     void paren::print_symbols() {
         int i = 0;
-        map<string, node> ordered(global_env.env.begin(), global_env.env.end());
+        map<string, node> ordered;
+        for (auto iter = global_env.env.begin(); iter != global_env.env.end(); iter++) {
+            ordered[symbols.names[iter->first]] = iter->second;
+        }
         for (auto iter = ordered.begin(); iter != ordered.end(); iter++) {
-            printf(" %s", iter->first.c_str());
+            *out << ' ' << iter->first;
             i++;
-            if (i % 10 == 0) puts("");
+            if (i % 10 == 0) *out << '\n';
         }
-        puts("");
+        *out << '\n';
     }
 
     void paren::print_functions() {
         int i = 0;
         map<string, int> ordered(builtin_map.begin(), builtin_map.end());
         for (auto iter = ordered.begin(); iter != ordered.end(); iter++) {
-            printf(" %s", iter->first.c_str());
+            *out << ' ' << iter->first;
             i++;
-            if (i % 10 == 0) puts("");
+            if (i % 10 == 0) *out << '\n';
         }
-        puts("");
+        *out << '\n';
     }
 
     void paren::print_logo() {
-        printf("Paren %s (C) 2013 Kim, Taegyoon\n", PAREN_VERSION);
-        puts("Predefined Symbols:");
+        *out << "Paren " << PAREN_VERSION << " (C) 2013 Kim, Taegyoon\n";
+        *out << "Predefined Symbols:\n";
         print_symbols();
-        puts("Functions:");
+        *out << "Functions:\n";
         print_functions();
-        puts("Etc.:");
-        puts(" (list) \"string\" ; end-of-line comment");
+        *out << "Etc.:\n";
+        *out << " (list) \"string\" ; end-of-line comment\n";
     }
 
     void paren::prompt() {
-        printf("> ");
+        *out << "> " << std::flush;
     }
 
     void paren::prompt2() {
-        printf("  ");
+        *out << "  " << std::flush;
     }
 
     inline void paren::init() {
-        srand((unsigned int) time(0));
-        global_env.env["true"] = node(true);
-        global_env.env["false"] = node(false);
-        global_env.env["E"] = node(2.71828182845904523536);
-        global_env.env["PI"] = node(3.14159265358979323846);
+        set("true", node(true));
+        set("false", node(false));
+        set("E", node(2.71828182845904523536));
+        set("PI", node(3.14159265358979323846));
 
         builtin_map["+"] = node::PLUS;
         builtin_map["-"] = node::MINUS;
@@ -880,19 +4643,48 @@ namespace libparen {
         builtin_map["apply"] = node::APPLY;
         builtin_map["map"] = node::MAP;
         builtin_map["filter"] = node::FILTER;
+        builtin_map["reduce"] = node::REDUCE;
+        builtin_map["pmap"] = node::PMAP;
+        builtin_map["pfilter"] = node::PFILTER;
+        builtin_map["preduce"] = node::PREDUCE;
         builtin_map["range"] = node::RANGE;
         builtin_map["nth"] = node::NTH;
         builtin_map["length"] = node::LENGTH;
+        builtin_map["conj"] = node::CONJ;
+        builtin_map["assoc-nth"] = node::ASSOC_NTH;
+        builtin_map["slice"] = node::SLICE;
         builtin_map["begin"] = node::BEGIN;
         builtin_map["set"] = node::SET;
         builtin_map["pr"] = node::PR;
         builtin_map["prn"] = node::PRN;
         builtin_map["exit"] = node::EXIT;
         builtin_map["system"] = node::SYSTEM;
+        builtin_map["f64vec"] = node::F64VEC;
+        builtin_map["i64vec"] = node::I64VEC;
+        builtin_map["to-list"] = node::TO_LIST;
+        builtin_map["sum"] = node::SUM;
+        builtin_map["dot"] = node::DOT;
+        builtin_map["min"] = node::MIN;
+        builtin_map["max"] = node::MAX;
+        builtin_map["hash-map"] = node::HASH_MAP;
+        builtin_map["get"] = node::GET;
+        builtin_map["put"] = node::PUT;
+        builtin_map["has?"] = node::HAS;
+        builtin_map["remove"] = node::REMOVE;
+        builtin_map["keys"] = node::KEYS;
+        builtin_map["vals"] = node::VALS;
+
+        for (auto iter = builtin_map.begin(); iter != builtin_map.end(); iter++) {
+            int id = symbols.intern(iter->first);
+            if (id >= (int) builtin_ids.size()) builtin_ids.resize(id + 1, -1);
+            builtin_ids[id] = iter->second;
+        }
     }
 
     node paren::eval_string(string &s) {
+        paren_scope ps(*this);
         auto vec = parse(s);
+        gc_root root(gc, vec);
         return eval_all(vec);
     }
 
@@ -901,37 +4693,602 @@ namespace libparen {
         return eval_string(s2);
     }
 
-    inline void paren::eval_print(string &s) {
-        cout << eval_string(s).str_with_type() << endl;
+    inline void paren::eval_print(vector<node> code) {
+        gc_root root(gc, code);
+        node result = eval_all(code);
+        *out << result.str_with_type() << endl;
     }
 
-    // read-eval-print loop
+    // read-eval-print loop. lines are read as they come, and an expression is evaluated when its last line ends
     void paren::repl() {
-        string code;
+        paren_scope ps(*this);
+        reader r;
         while (true) {
-            if (code.length() == 0) prompt(); else prompt2();
+            if (r.unclosed <= 0) prompt(); else prompt2();
             string line;
-            if (!getline(cin, line)) { // EOF
-                eval_print(code);
+            if (!getline(*in, line)) { // EOF
+                r.finish();
+                r.read(symbols);
+                eval_print(r.take());
                 return;
             }
-            code += '\n' + line;
-            tokenizer t(code);
-            t.tokenize();
-            if (t.unclosed <= 0) { // no unmatched parenthesis nor quotation
-                eval_print(code);
-                code = "";
+            line.insert(line.begin(), '\n');
+            r.input(line);
+            r.read(symbols);
+            if (r.unclosed <= 0) { // no unmatched parenthesis nor quotation
+                eval_print(r.take());
             }
         }
     }
 
-    node &paren::get(const char* name) {
-        string s(name);
-        return global_env.get(s);
+    node paren::get(const char* name) {
+        return get(symbols.intern(name));
+    }
+
+    node paren::get(int id) {
+        node *v = global_env.find(id);
+        return v != NULL ? *v : node();
     }
 
+    // copies into the current heap the objects of another heap that a value refers to, so that it
+    // stays valid when that heap is destroyed. fns and seqs belong to the interpreter that made them
+    // and cannot be copied. objects of the current heap are kept as they are
+    class adopter {
+    private:
+        heap &h;
+        unordered_map<object *, node> copies; // of each object met, so that shared structure stays shared
+        vector<node> made; // the copies, reachable only from here until stored
+        gc_root root;
+    public:
+        adopter(heap &h): h(h), root(h, made) {}
+        bool adopt(node &n) { // false if n refers to a fn or seq of another heap
+            if (!n.is_object() || h.owns(n.v_obj)) return true;
+            auto found = copies.find(n.v_obj);
+            if (found != copies.end()) {
+                n = found->second;
+                return true;
+            }
+            object *o = n.v_obj;
+            node r;
+            switch (n.type) {
+            case node::T_STRING:
+                r = node(n.v_string());
+                break;
+            case node::T_VEC: {
+                vec_object *v = new vec_object(vec_of(n)->ints);
+                v->f64 = vec_of(n)->f64;
+                v->i64 = vec_of(n)->i64;
+                r = vec_node(v);
+                break;}
+            case node::T_LIST: {
+                vector<node> items(n.v_list().begin(), n.v_list().end());
+                for (size_t i = 0; i < items.size(); i++) {
+                    if (!adopt(items[i])) return false;
+                }
+                r = node(items);
+                break;}
+            case node::T_MAP: {
+                map_object *m = (map_object *) o;
+                r = node(node::T_MAP, new map_object);
+                copies[o] = r; // before the keys and values, that may refer to the map
+                made.push_back(r);
+                for (size_t i = 0; i < m->slots.size(); i++) {
+                    if (m->ctrl[i] < 0) continue;
+                    node key = m->slots[i].key, value = m->slots[i].value;
+                    if (!adopt(key) || !adopt(value)) return false;
+                    ((map_object *) r.v_obj)->put(key) = value;
+                }
+                n = r;
+                return true;}
+            default:
+                return false;
+            }
+            copies[o] = r;
+            made.push_back(r);
+            n = r;
+            return true;
+        }
+    };
+
     void paren::set(const char* name, node value) {
-        string s(name);
-        global_env.env[s] = value;
+        set(symbols.intern(name), value);
+    }
+
+    void paren::set(int id, node value) {
+        paren_scope ps(*this);
+        adopter a(gc);
+        if (!a.adopt(value)) {
+            *err << "Cannot set a fn or seq of another interpreter: " << symbols.names[id] << endl;
+            return;
+        }
+        global_env.env[id] = value;
+    }
+
+    // image of the global variables and everything reachable from them: a header, the names of all
+    // symbols, the objects, the global variables. objects are numbered in the order they are written:
+    // strings, vectors, scopes, frames, fns, seqs, then lists, each list after the lists among its items, so that
+    // every object is made from earlier ones. frames, fns and seqs are made empty and filled in after
+    // the lists. a reference to an object is 0 for none, 1 for the global environment, else its number + 2
+    enum {SNAP_STRING, SNAP_VEC, SNAP_SCOPE, SNAP_FRAME, SNAP_FN, SNAP_SEQ, SNAP_MAP, SNAP_LIST, SNAP_KINDS};
+    static const char SNAP_MAGIC[8] = {'P', 'A', 'R', 'E', 'N', 'S', 0, 3}; // format 3
+
+    static uint64_t builtin_fingerprint(paren &p) { // builtins are held by number
+        string s = PAREN_VERSION;
+        map<string, int> sorted(p.builtin_map.begin(), p.builtin_map.end());
+        for (auto iter = sorted.begin(); iter != sorted.end(); iter++) s += " " + iter->first + "=" + to_string(iter->second);
+        return paren::hash(s);
+    }
+
+    class object_index { // object => index. open addressing: a snapshot looks up every reference
+    private:
+        vector<pair<object *, size_t> > slots; // NULL if empty
+        size_t used;
+        size_t slot_of(object *o) const {
+            size_t mask = slots.size() - 1;
+            size_t i = (size_t) (((uintptr_t) o >> 4) * 0x9e3779b97f4a7c15ULL >> 20) & mask;
+            while (slots[i].first != NULL && slots[i].first != o) i = (i + 1) & mask;
+            return i;
+        }
+    public:
+        object_index(): slots(16), used(0) {}
+        bool insert(object *o, size_t v) { // false if o is in already
+            if ((used + 1) * 2 > slots.size()) {
+                vector<pair<object *, size_t> > old(slots.size() * 2);
+                old.swap(slots);
+                for (size_t i = 0; i < old.size(); i++) {
+                    if (old[i].first != NULL) slots[slot_of(old[i].first)] = old[i];
+                }
+            }
+            size_t i = slot_of(o);
+            if (slots[i].first != NULL) return false;
+            slots[i] = make_pair(o, v);
+            used++;
+            return true;
+        }
+        size_t operator[](object *o) const {return slots[slot_of(o)].second;} // o must be in
+    };
+
+    class snapshot_writer: public byte_writer {
+    private:
+        struct record {
+            object *o;
+            int kind;
+            size_t number; // SIZE_MAX until numbered
+        };
+        paren &p;
+        object_index index; // reached objects => index into records
+        vector<record> records; // in the order reached
+        vector<size_t> work; // records of objects reached, what they refer to not yet
+        vector<size_t> order; // records, by number
+    public:
+        snapshot_writer(string &out, paren &p): byte_writer(out), p(p) {}
+        void reach(object *o, int kind) {
+            if (o == NULL || o == &p.global_env) return;
+            if (!index.insert(o, records.size())) return;
+            record r = {o, kind, SIZE_MAX};
+            work.push_back(records.size());
+            records.push_back(r);
+        }
+        void reach(const node &n) {
+            switch (n.type) {
+            case node::T_STRING: reach(n.v_obj, SNAP_STRING); break;
+            case node::T_LIST: reach(n.v_obj, SNAP_LIST); break;
+            case node::T_FN: reach(n.v_obj, SNAP_FN); break;
+            case node::T_SEQ: reach(n.v_obj, SNAP_SEQ); break;
+            case node::T_VEC: reach(n.v_obj, SNAP_VEC); break;
+            case node::T_MAP: reach(n.v_obj, SNAP_MAP); break;
+            default: break;
+            }
+        }
+        void reach_all() {
+            for (auto iter = p.global_env.env.begin(); iter != p.global_env.env.end(); iter++) reach(iter->second);
+            while (!work.empty()) {
+                record r = records[work.back()];
+                work.pop_back();
+                switch (r.kind) {
+                case SNAP_FRAME: {
+                    environment *e = (environment *) r.o;
+                    reach(e->sc, SNAP_SCOPE);
+                    reach(e->outer, SNAP_FRAME);
+                    for (size_t i = 0; i < e->sc->names.size(); i++) reach(e->slots[i]);
+                    for (auto iter = e->env.begin(); iter != e->env.end(); iter++) reach(iter->second);
+                    break;}
+                case SNAP_FN:
+                    reach(((fn_object *) r.o)->code);
+                    reach(((fn_object *) r.o)->env, SNAP_FRAME);
+                    break;
+                case SNAP_SEQ: {
+                    seq_object *s = (seq_object *) r.o;
+                    for (size_t i = 0; i < s->stages.size(); i++) reach(s->stages[i].f);
+                    reach(s->items.load(), SNAP_LIST);
+                    break;}
+                case SNAP_MAP: {
+                    map_object *m = (map_object *) r.o;
+                    for (size_t i = 0; i < m->slots.size(); i++) {
+                        if (m->ctrl[i] < 0) continue;
+                        reach(m->slots[i].key);
+                        reach(m->slots[i].value);
+                    }
+                    break;}
+                case SNAP_LIST: {
+                    list_object *l = (list_object *) r.o;
+                    for (size_t i = 0; i < l->size(); i++) reach((*l)[i]);
+                    reach(l->sc, SNAP_SCOPE);
+                    break;}
+                }
+            }
+        }
+        void number(size_t i) {
+            records[i].number = order.size();
+            order.push_back(i);
+        }
+        void number_all() {
+            for (int kind = 0; kind < SNAP_LIST; kind++) {
+                for (size_t i = 0; i < records.size(); i++) {
+                    if (records[i].kind == kind) number(i);
+                }
+            }
+            vector<bool> entered(records.size());
+            vector<pair<size_t, size_t> > stack; // records of lists being numbered, next item to look at
+            for (size_t i = 0; i < records.size(); i++) {
+                if (records[i].kind != SNAP_LIST || entered[i]) continue;
+                entered[i] = true;
+                stack.push_back(make_pair(i, 0));
+                while (!stack.empty()) {
+                    list_object *top = (list_object *) records[stack.back().first].o;
+                    size_t &next = stack.back().second;
+                    if (next == top->size()) {
+                        number(stack.back().first);
+                        stack.pop_back();
+                        continue;
+                    }
+                    const node &item = (*top)[next++];
+                    if (item.type != node::T_LIST) continue;
+                    size_t j = index[item.v_obj];
+                    if (entered[j]) continue;
+                    entered[j] = true;
+                    stack.push_back(make_pair(j, 0));
+                }
+            }
+        }
+        void ref(object *o) {
+            if (o == NULL) varint(0);
+            else if (o == &p.global_env) varint(1);
+            else varint(records[index[o]].number + 2);
+        }
+        void write(const node &n) {
+            out += (char) n.type;
+            switch (n.type) {
+            case node::T_INT: raw(n.v_int); break;
+            case node::T_DOUBLE: raw(n.v_double); break;
+            case node::T_BOOL: out += (char) n.v_bool; break;
+            case node::T_SYMBOL: varint(n.v_int); break;
+            case node::T_BUILTIN: varint(generic(n.v_int)); break; // quickened forms are respecialized after loading
+            case node::T_LOCAL:
+                varint(n.v_addr.id);
+                varint(n.v_addr.depth);
+                varint(n.v_addr.slot);
+                break;
+            case node::T_STRING: case node::T_LIST: case node::T_FN: case node::T_SEQ: case node::T_VEC: case node::T_MAP: ref(n.v_obj); break;
+            default: break;
+            }
+        }
+        void write_objects() {
+            varint(order.size());
+            for (size_t i = 0; i < order.size(); i++) { // what each is made from
+                const record &r = records[order[i]];
+                out += (char) r.kind;
+                switch (r.kind) {
+                case SNAP_STRING: bytes(((string_object *) r.o)->view()); break;
+                case SNAP_VEC: { // the items in the byte order of the machine. not the list made of them
+                    vec_object *v = (vec_object *) r.o;
+                    out += (char) v->ints;
+                    bytes(string_view(v->ints ? (const char *) v->i64.data() : (const char *) v->f64.data(), v->size() * 8));
+                    break;}
+                case SNAP_SCOPE: {
+                    scope *sc = (scope *) r.o;
+                    out += (char) sc->captures;
+                    varint(sc->names.size());
+                    for (size_t j = 0; j < sc->names.size(); j++) varint(sc->names[j]);
+                    break;}
+                case SNAP_FRAME: ref(((environment *) r.o)->sc); break;
+                case SNAP_LIST: {
+                    list_object *l = (list_object *) r.o;
+                    varint(l->size());
+                    for (size_t j = 0; j < l->size(); j++) write((*l)[j]);
+                    ref(l->sc);
+                    break;}
+                }
+            }
+            for (size_t i = 0; i < order.size(); i++) { // the contents of the empty ones
+                const record &r = records[order[i]];
+                switch (r.kind) {
+                case SNAP_FRAME: {
+                    environment *e = (environment *) r.o;
+                    ref(e->outer);
+                    for (size_t j = 0; j < e->sc->names.size(); j++) write(e->slots[j]);
+                    write_variables(*e);
+                    break;}
+                case SNAP_FN:
+                    write(((fn_object *) r.o)->code);
+                    ref(((fn_object *) r.o)->env);
+                    break;
+                case SNAP_SEQ: {
+                    seq_object *s = (seq_object *) r.o;
+                    write(s->from);
+                    write(s->last);
+                    write(s->step);
+                    varint(s->stages.size());
+                    for (size_t j = 0; j < s->stages.size(); j++) {
+                        write(s->stages[j].f);
+                        out += (char) s->stages[j].filter;
+                    }
+                    ref(s->items.load());
+                    break;}
+                case SNAP_MAP: {
+                    map_object *m = (map_object *) r.o;
+                    varint(m->count);
+                    for (size_t j = 0; j < m->slots.size(); j++) {
+                        if (m->ctrl[j] < 0) continue;
+                        write(m->slots[j].key);
+                        write(m->slots[j].value);
+                    }
+                    break;}
+                }
+            }
+        }
+        void write_variables(environment &e) {
+            varint(e.env.size());
+            for (auto iter = e.env.begin(); iter != e.env.end(); iter++) {
+                varint(iter->first);
+                write(iter->second);
+            }
+        }
+    };
+
+    string paren::snapshot() {
+        paren_scope ps(*this);
+        string body;
+        snapshot_writer w(body, *this);
+        w.varint(symbols.names.size());
+        for (size_t i = 0; i < symbols.names.size(); i++) w.bytes(symbols.names[i]);
+        w.reach_all();
+        w.number_all();
+        w.write_objects();
+        w.write_variables(global_env);
+
+        string out(SNAP_MAGIC, sizeof(SNAP_MAGIC));
+        byte_writer h(out);
+        h.raw(SER_ORDER);
+        h.raw(builtin_fingerprint(*this));
+        h.raw(hash(body)); // corruption would otherwise go unnoticed until the objects are used
+        return out + body;
+    }
+
+    class snapshot_reader: public byte_reader {
+    private:
+        paren &p;
+        vector<int> ids; // symbol ID of each name in the file
+        vector<object *> objects;
+        vector<char> kinds;
+    public:
+        snapshot_reader(string_view data, paren &p): byte_reader(data), p(p) {}
+        bool symbol_names() {
+            uint64_t n;
+            if (!count(n)) return false;
+            for (uint64_t i = 0; i < n; i++) {
+                string_view name;
+                if (!bytes(name)) return false;
+                ids.push_back(p.symbols.intern(name));
+            }
+            return true;
+        }
+        bool id(int &v) {
+            uint64_t i;
+            if (!varint(i) || i >= ids.size()) return false;
+            v = ids[i];
+            return true;
+        }
+        bool byte(unsigned char &b) {return raw(b);}
+        template <class T> bool ref(T *&o, int kind, bool null_ok) { // of an object read so far
+            uint64_t r;
+            if (!varint(r)) return false;
+            if (r == 0) {
+                o = NULL;
+                return null_ok;
+            }
+            if (r == 1) {
+                if (kind != SNAP_FRAME) return false;
+                o = (T *) (object *) &p.global_env;
+                return true;
+            }
+            if (r - 2 >= objects.size() || kinds[r - 2] != kind) return false;
+            o = (T *) objects[r - 2];
+            return true;
+        }
+        bool read(node &n) {
+            unsigned char type;
+            if (!byte(type)) return false;
+            n = node();
+            n.type = (decltype(n.type)) type;
+            switch (type) {
+            case node::T_NIL: return true;
+            case node::T_INT: return raw(n.v_int);
+            case node::T_DOUBLE: return raw(n.v_double);
+            case node::T_BOOL: {
+                unsigned char b;
+                if (!byte(b)) return false;
+                n.v_bool = b != 0;
+                return true;}
+            case node::T_SYMBOL: return id(n.v_int);
+            case node::T_BUILTIN: {
+                uint64_t b;
+                if (!varint(b) || b >= node::PLUS_II) return false;
+                n.v_int = (int) b;
+                return true;}
+            case node::T_LOCAL: {
+                uint64_t depth, slot;
+                if (!id(n.v_addr.id) || !varint(depth) || !varint(slot) || depth > USHRT_MAX || slot > USHRT_MAX) return false;
+                n.v_addr.depth = depth;
+                n.v_addr.slot = slot;
+                return true;}
+            case node::T_STRING: return ref(n.v_obj, SNAP_STRING, false);
+            case node::T_LIST: return ref(n.v_obj, SNAP_LIST, false);
+            case node::T_FN: return ref(n.v_obj, SNAP_FN, false);
+            case node::T_SEQ: return ref(n.v_obj, SNAP_SEQ, false);
+            case node::T_VEC: return ref(n.v_obj, SNAP_VEC, false);
+            case node::T_MAP: return ref(n.v_obj, SNAP_MAP, false);
+            default: return false;
+            }
+        }
+        bool make_objects() {
+            uint64_t n;
+            if (!count(n)) return false;
+            vector<node> items;
+            for (uint64_t i = 0; i < n; i++) {
+                unsigned char kind;
+                if (!byte(kind)) return false;
+                object *o;
+                switch (kind) {
+                case SNAP_STRING: {
+                    string_view v;
+                    if (!bytes(v)) return false;
+                    o = node(string(v)).v_obj;
+                    break;}
+                case SNAP_VEC: {
+                    unsigned char ints;
+                    string_view v;
+                    if (!byte(ints) || !bytes(v) || v.size() % 8 != 0) return false;
+                    vec_object *vec = new vec_object(ints != 0);
+                    if (vec->ints) vec->i64.resize(v.size() / 8); else vec->f64.resize(v.size() / 8);
+                    if (!v.empty()) memcpy(vec->ints ? (void *) vec->i64.data() : (void *) vec->f64.data(), v.data(), v.size());
+                    o = vec_node(vec).v_obj;
+                    break;}
+                case SNAP_SCOPE: {
+                    unsigned char captures;
+                    uint64_t names;
+                    if (!byte(captures) || !count(names)) return false;
+                    scope *sc = new scope;
+                    sc->captures = captures != 0;
+                    sc->names.resize(names);
+                    for (uint64_t j = 0; j < names; j++) {
+                        if (!id(sc->names[j])) return false;
+                    }
+                    o = sc;
+                    break;}
+                case SNAP_FRAME: {
+                    scope *sc;
+                    if (!ref(sc, SNAP_SCOPE, false)) return false;
+                    o = heap_frame(p.gc, NULL, sc);
+                    break;}
+                case SNAP_FN:
+                    o = new fn_object;
+                    break;
+                case SNAP_SEQ:
+                    o = new seq_object(&p, node(), node(), node());
+                    break;
+                case SNAP_MAP:
+                    o = new map_object;
+                    break;
+                case SNAP_LIST: {
+                    uint64_t size;
+                    if (!count(size)) return false;
+                    items.resize(size);
+                    for (uint64_t j = 0; j < size; j++) {
+                        if (!read(items[j])) return false;
+                    }
+                    list_object *l = list_object::make(items.data(), size);
+                    if (!ref(l->sc, SNAP_SCOPE, true)) return false;
+                    o = l;
+                    break;}
+                default:
+                    return false;
+                }
+                objects.push_back(o);
+                kinds.push_back(kind);
+            }
+            return true;
+        }
+        bool fill_objects() {
+            for (size_t i = 0; i < objects.size(); i++) {
+                switch (kinds[i]) {
+                case SNAP_FRAME: {
+                    environment *e = (environment *) objects[i];
+                    if (!ref(e->outer, SNAP_FRAME, false)) return false;
+                    for (size_t j = 0; j < e->sc->names.size(); j++) {
+                        if (!read(e->slots[j])) return false;
+                    }
+                    vector<pair<int, node> > vars;
+                    if (!variables(vars)) return false;
+                    for (size_t j = 0; j < vars.size(); j++) e->env[vars[j].first] = vars[j].second;
+                    break;}
+                case SNAP_FN: {
+                    fn_object *f = (fn_object *) objects[i];
+                    if (!read(f->code) || f->code.type != node::T_LIST || !ref(f->env, SNAP_FRAME, false)) return false;
+                    break;}
+                case SNAP_SEQ: {
+                    seq_object *s = (seq_object *) objects[i];
+                    uint64_t stages;
+                    if (!read(s->from) || !read(s->last) || !read(s->step) || !count(stages)) return false;
+                    s->stages.resize(stages);
+                    for (uint64_t j = 0; j < stages; j++) {
+                        unsigned char filter;
+                        if (!read(s->stages[j].f) || !byte(filter)) return false;
+                        s->stages[j].filter = filter != 0;
+                    }
+                    p.gc.account(s->extra());
+                    list_object *items;
+                    if (!ref(items, SNAP_LIST, true)) return false;
+                    s->items = items;
+                    break;}
+                case SNAP_MAP: {
+                    map_object *m = (map_object *) objects[i];
+                    uint64_t n;
+                    if (!count(n)) return false;
+                    for (uint64_t j = 0; j < n; j++) {
+                        node k, v;
+                        if (!read(k) || !read(v) || !is_key(k)) return false;
+                        m->put(k) = v;
+                    }
+                    break;}
+                }
+            }
+            return true;
+        }
+        bool variables(vector<pair<int, node> > &vars) {
+            uint64_t n;
+            if (!count(n)) return false;
+            vars.resize(n);
+            for (uint64_t i = 0; i < n; i++) {
+                if (!id(vars[i].first) || !read(vars[i].second)) return false;
+            }
+            return true;
+        }
+    };
+
+    bool paren::restore(string_view data) {
+        paren_scope ps(*this);
+        byte_reader h(data);
+        char magic[sizeof(SNAP_MAGIC)];
+        uint32_t order;
+        uint64_t fingerprint, body_hash;
+        if (!h.raw(magic) || memcmp(magic, SNAP_MAGIC, sizeof(magic)) != 0) return false;
+        if (!h.raw(order) || order != SER_ORDER) return false;
+        if (!h.raw(fingerprint) || fingerprint != builtin_fingerprint(*this)) return false;
+        if (!h.raw(body_hash)) return false;
+        string_view body(h.p, h.end - h.p);
+        if (hash(body) != body_hash) return false;
+
+        // nothing made is reachable until the globals are set, so do not collect meanwhile
+        size_t saved_heap_size = gc.heap_size;
+        gc.heap_size = SIZE_MAX;
+        snapshot_reader r(body, *this);
+        vector<pair<int, node> > vars;
+        bool ok = r.symbol_names() && r.make_objects() && r.fill_objects() && r.variables(vars) && r.done();
+        if (ok) {
+            for (size_t i = 0; i < vars.size(); i++) set(vars[i].first, vars[i].second);
+        }
+        gc.heap_size = saved_heap_size;
+        return ok;
     }
 } // namespace libparen
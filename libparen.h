@@ -15,36 +15,80 @@
 #include <map>
 #include <ctime>
 #include <memory>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <string_view>
 
 #define PAREN_VERSION "1.4.2"
 
 namespace libparen {
     using namespace std;
 
-    struct node {
-        enum {T_NIL, T_INT, T_DOUBLE, T_BOOL, T_STRING, T_SYMBOL, T_LIST, T_BUILTIN, T_FN} type;
+    struct lexical_address { // of a local variable
+        int id; // symbol ID
+        unsigned short depth; // number of fn scopes to go out
+        unsigned short slot; // index into environment::slots
+    };
+
+    class heap;
+    struct list_object;
+    struct paren;
+    class thread_pool;
+    class native_code;
+    class profiler;
+
+    struct object { // memory owned by a heap: the part of a string, list or fn, a scope, or an activation frame
+        unsigned int mark; // number of the last collection that reached it
+        object(): mark(0) {}
+        virtual ~object() {}
+        virtual void trace(heap &h) {} // mark the objects this refers to
+        virtual size_t extra() const {return 0;} // bytes held outside the object
+        void *operator new(size_t size); // from heap::current()
+        void *operator new(size_t size, void *p) {return p;}
+        void operator delete(void *) {} // freed by the collector
+        void operator delete(void *, void *) {}
+    };
+
+    struct node { // 16 bytes: a type tag and an immediate value or object pointer. copied bitwise
+        enum {T_NIL, T_INT, T_DOUBLE, T_BOOL, T_STRING, T_SYMBOL, T_LIST, T_BUILTIN, T_FN, T_LOCAL, T_SEQ, T_VEC, T_MAP} type;
         enum builtin {PLUS, MINUS, MUL, DIV, CARET, PERCENT, SQRT, INC, DEC, PLUSPLUS, MINUSMINUS, FLOOR, CEIL, LN, LOG10, RAND,
             EQEQ, NOTEQ, LT, GT, LTE, GTE, ANDAND, OROR, NOT,
             IF, WHEN, FOR, WHILE,
             STRLEN, STRCAT, CHAR_AT, CHR,
             INT, DOUBLE, STRING, READ_STRING, TYPE, SET,
-            EVAL, QUOTE, FN, LIST, APPLY, MAP, FILTER, RANGE, NTH, LENGTH, BEGIN,
-            PR, PRN, EXIT, SYSTEM};
+            EVAL, QUOTE, FN, LIST, APPLY, MAP, FILTER, REDUCE, PMAP, PFILTER, PREDUCE, RANGE, NTH, LENGTH, CONJ, ASSOC_NTH, SLICE, BEGIN,
+            PR, PRN, EXIT, SYSTEM,
+            F64VEC, I64VEC, TO_LIST, SUM, DOT, MIN, MAX,
+            HASH_MAP, GET, PUT, HAS, REMOVE, KEYS, VALS,
+            // quickened forms, that eval rewrites a call into for the operand types it has seen. not bound to names
+            PLUS_II, MINUS_II, MUL_II, DIV_II, EQEQ_II, NOTEQ_II, LT_II, GT_II, LTE_II, GTE_II, // two ints
+            PLUS_DD, MINUS_DD, MUL_DD, DIV_DD, EQEQ_DD, NOTEQ_DD, LT_DD, GT_DD, LTE_DD, GTE_DD, // two doubles
+            NTH_LIST, // an int index into a list
+            NATIVE}; // NATIVE + 2 * K is a for, and NATIVE + 2 * K + 1 a while, compiled to machine code K
         union {
-            int v_int;
+            int v_int; // also the symbol ID of a T_SYMBOL, and the builtin of a T_BUILTIN
             double v_double;
             bool v_bool;
+            lexical_address v_addr; // if T_LOCAL, a symbol resolved inside a fn body
+            object *v_obj; // if T_STRING, T_LIST, T_FN, T_SEQ, T_VEC or T_MAP
         };
-        string v_string;
-        vector<node> v_list;
-        shared_ptr<void> env; // if T_FN, actually (environment *). to avoid mutual reference
 
         node();
         node(int a);
         node(double a);
         node(bool a);
-        node(const string a);
+        node(const char *a); // strings and lists are allocated on heap::current()
+        node(const string &a);
         node(const vector<node> &a);
+        node(int type, object *o);
+
+        bool is_object() const;
+        const string &v_string() const; // T_STRING, or the name of a T_SYMBOL or T_LOCAL. flattens a view of a buffer
+        list_object &v_list() const; // T_LIST, the code of a T_FN, or the items of a T_SEQ or T_VEC
 
         int to_int(); // convert to int
         double to_double(); // convert to double
@@ -53,26 +97,431 @@ namespace libparen {
         string str_with_type();
     };
 
-    struct environment {
-        unordered_map<string, node> env;
+    // a string, or a view of one that strcat made: the first len characters of a buffer that strcat
+    // appends to in place while the view is its longest, so that a string is built in linear time
+    struct string_object: object {
+        string v; // the characters, unless a view
+        atomic<string_object *> buf; // if a view, the buffer. it only grows, so the characters of a view do not change
+        size_t len;
+        string_object(string_view v): v(v), buf(NULL), len(0) {}
+        string_object(string_object *buf, size_t len): buf(buf), len(len) {}
+        size_t size() const {return buf != NULL ? len : v.size();}
+        string_view view() const { // until the buffer grows
+            string_object *b = buf;
+            return b != NULL ? string_view(b->v.data(), len) : string_view(v);
+        }
+        const string &flatten(); // v, copied from the buffer first if a view. workers of a parallel region may flatten at once
+        size_t extra() const {return v.capacity();}
+        void trace(heap &h);
+    };
+
+    struct scope: object { // local variables of a fn: arguments, then symbols set in the body
+        vector<int> names; // symbol ID of each slot
+        bool captures; // if the body may create closures over its frame
+        scope(): captures(false) {}
+    };
+
+    struct list_leaf: object { // 32 items of the trie of a list
+        node items[32];
+        void trace(heap &h);
+    };
+
+    struct list_branch: object { // 32 subtries of the trie of a list
+        object *child[32]; // list_branch, or list_leaf one level above the leaves
+        list_branch() {memset(child, 0, sizeof(child));}
+        void trace(heap &h);
+    };
+
+    // persistent vector: positions [start, start + count) of a 32-way trie of full leaves. the positions
+    // from tail_off on are kept in the tail, inline after the object, so a list of up to 32 items is one
+    // array. conj, assoc and slice return a new list that copies the path they change and shares the rest
+    struct list_object: object {
+        class iterator { // random access by index
+        private:
+            const list_object *l;
+            size_t i;
+        public:
+            typedef forward_iterator_tag iterator_category;
+            typedef node value_type;
+            typedef ptrdiff_t difference_type;
+            typedef node *pointer;
+            typedef node &reference;
+            iterator(const list_object *l, size_t i): l(l), i(i) {}
+            node &operator*() const {return (*l)[i];}
+            node *operator->() const {return &(*l)[i];}
+            iterator &operator++() {i++; return *this;}
+            iterator operator++(int) {iterator old = *this; i++; return old;}
+            iterator operator+(size_t n) const {return iterator(l, i + n);}
+            bool operator==(const iterator &a) const {return i == a.i;}
+            bool operator!=(const iterator &a) const {return i != a.i;}
+        };
+
+        size_t count;
+        size_t start; // position of the first item. nonzero after slice
+        size_t tail_off; // position of tail()[0]. all earlier positions are in the trie
+        unsigned int shift; // level of root: 5 * levels of branches
+        unsigned int tail_size; // start + count - tail_off
+        object *root; // list_branch, NULL if the trie is empty
+        scope *sc; // if the argument list of a resolved fn
+
+        node *tail() const {return (node *) (this + 1);}
+        size_t size() const {return count;}
+        bool empty() const {return count == 0;}
+        node &operator[](size_t i) const { // code lists are rewritten in place through this
+            size_t p = start + i;
+            return p >= tail_off ? tail()[p - tail_off] : leaf(p)->items[p & 31];
+        }
+        node &at(size_t i) const; // throws out_of_range
+        iterator begin() const {return iterator(this, 0);}
+        iterator end() const {return iterator(this, count);}
+        const node *data() const {return start >= tail_off ? tail() + (start - tail_off) : NULL;} // NULL if the items are not contiguous
+        void trace(heap &h);
+
+        static list_object *make(const node *items, size_t n); // on heap::current()
+        static list_object &empty_list(); // outside any heap
+        list_object *conj(const node &x) const; // with x appended
+        list_object *assoc(size_t i, const node &x) const; // with item i replaced by x
+        list_object *slice(size_t from, size_t to) const; // items [from, to)
+    private:
+        list_leaf *leaf(size_t p) const; // the leaf holding position p
+        static list_object *alloc(size_t tail_size);
+        list_object();
+    };
+
+    // lazy sequence: the items of a range, passed through the map and filter stages in one pass when
+    // consumed. map or filter of a seq not yet realized returns a new seq with one more stage
+    struct seq_object: object {
+        struct stage {
+            node f;
+            bool filter; // keep the items for which f is true, else replace each item with f of it
+        };
+        node from, last, step; // of the range. ints, or doubles
+        vector<stage> stages;
+        atomic<list_object *> items; // once realized. workers of a parallel region may realize it at once: the first to finish sets it
+        paren *owner; // calls the fns of the stages
+        seq_object(paren *owner, const node &from, const node &last, const node &step);
+        seq_object *then(const node &f, bool filter) const; // with a stage appended
+        list_object &list(); // the items, realized on first use
+        size_t extra() const {return stages.capacity() * sizeof(stage);}
+        void trace(heap &h);
+    };
+
+    // f64vec or i64vec: numbers unboxed in one array, that arithmetic works on a whole vector at a
+    // time. the items are not changed once made. read as a list, they are boxed once, on first use
+    struct vec_object: object {
+        bool ints; // i64vec, else f64vec
+        vector<double> f64; // the items of an f64vec
+        vector<int64_t> i64; // of an i64vec
+        atomic<list_object *> items; // as nodes, once made. set as the items of a seq are
+        vec_object(bool ints): ints(ints), items(NULL) {}
+        size_t size() const {return ints ? i64.size() : f64.size();}
+        node at(size_t i) const; // throws out_of_range
+        list_object &list();
+        size_t extra() const {return (f64.capacity() + i64.capacity()) * 8;}
+        void trace(heap &h);
+    };
+
+    // hash map, changed in place, from ints, doubles, strings, symbols and bools to values. keys of
+    // different types are different. open addressing with a control byte per slot, as in SwissTable:
+    // the low 7 bits of the hash of the key of a full slot, or EMPTY or DELETED. slots are probed in
+    // groups of 16, whose control bytes are compared with the hash at once
+    struct map_object: object {
+        struct slot {
+            node key, value;
+        };
+        enum {GROUP = 16};
+        vector<signed char> ctrl; // of each slot
+        vector<slot> slots; // a multiple of GROUP, a power of 2
+        size_t count; // of keys
+        size_t growth; // empty slots that may yet be filled before the table is rebuilt
+        map_object();
+        node *find(const node &key); // value of key, NULL if not in
+        node &put(const node &key); // value of key, added as nil if new
+        bool remove(const node &key); // false if not in
+        size_t extra() const {return slots.capacity() * sizeof(slot) + ctrl.capacity();}
+        void trace(heap &h);
+    private:
+        size_t lookup(const node &key, uint64_t h) const;
+        size_t free_slot(uint64_t h) const;
+        void rebuild(size_t capacity);
+    };
+
+    class symbol_names { // of symbol IDs. added to under the lock of the table; a name never moves, so reading needs no lock
+    public:
+        symbol_names(): count(0) {}
+        ~symbol_names();
+        const string &operator[](int id) const {return chunks[id >> CHUNK_BITS][id & (CHUNK - 1)];}
+        size_t size() const {return count.load(memory_order_acquire);}
+        void push_back(string_view name);
+        const string &back() const {return (*this)[(int) size() - 1];}
+    private:
+        enum {CHUNK_BITS = 12, CHUNK = 1 << CHUNK_BITS, CHUNKS = 1 << 16};
+        string *chunks[CHUNKS]; // allocated as needed
+        atomic<size_t> count;
+        symbol_names(const symbol_names &);
+        symbol_names &operator=(const symbol_names &);
+    };
+
+    // interned symbol names, one table for all interpreters, so that a symbol node names its symbol in
+    // any of them and on any thread. a symbol ID is an index into names
+    struct symbol_table {
+        unordered_map<string_view, int> ids; // keys are views of names
+        symbol_names names;
+        mutex lock; // of interning
+        int intern(string_view name); // ID of name, added if new
+        static symbol_table &global();
+    };
+
+    struct environment: object { // the global environment, or the activation frame of a fn call
+        unordered_map<int, node> env; // symbol ID => value. globals, and locals unknown to sc
+        node *slots; // local variables, indexed by lexical_address::slot
+        scope *sc; // NULL for the global environment
         environment *outer;
         environment();
-        environment(environment *outer);
-        node &get(const string &name);
+        environment(environment *outer, scope *sc, node *slots);
+        node *find(int id); // variable of this or an outer environment, NULL if unbound
+        node &define(int id); // variable of this environment, created if new
+        static atomic<unsigned int> version; // changed when a variable is added to the map of a local environment
+        void trace(heap &h);
+    };
+
+    struct fn_object: object { // lexical closure
+        node code; // (fn (ARGUMENT ..) BODY ..)
+        environment *env; // where the fn was evaluated. outer environment of its calls
+        fn_object(): env(NULL) {}
+        void trace(heap &h);
+    };
+
+    class frame_arena { // stack-discipline allocator for activation frames
+    public:
+        struct mark {
+            size_t block, used;
+        };
+        frame_arena(): block(0), used(0) {}
+        ~frame_arena();
+        mark save() const {
+            mark m = {block, used};
+            return m;
+        }
+        void restore(const mark &m) { // frees everything allocated after m
+            block = m.block;
+            used = m.used;
+        }
+        void *alloc(size_t n);
+    private:
+        vector<pair<char *, size_t> > blocks; // memory, size
+        size_t block, used; // top of the stack
+        frame_arena(const frame_arena &);
+        frame_arena &operator=(const frame_arena &);
+    };
+
+    // mark-sweep garbage collector. objects live in pages of equal-sized slots, large ones on their own.
+    // roots are the registered environments and vectors, and any word on the native stack of the
+    // collecting thread that points into an object (conservative scanning), so nodes held in C++
+    // local variables stay alive. nodes kept elsewhere outside the heap need a gc_root.
+    // while the heap is shared with pool workers it locks each allocation and does not collect, so
+    // the workers do not register their roots
+    class heap {
+    public:
+        struct statistics {
+            size_t collections;
+            size_t allocated_objects; // since the heap was created
+            size_t allocated_bytes;
+            size_t freed_objects;
+            size_t live_objects; // in use now
+            size_t live_bytes;
+            double pause_ms; // total time spent collecting
+            double max_pause_ms;
+        };
+        struct call { // a call in progress
+            environment *env; // its activation frame
+            object *fn; // the closure running, whose code may be referenced from nowhere else
+        };
+        size_t heap_size; // collect when live_bytes reaches this, or twice the bytes that survived the last collection
+        statistics stats;
+        vector<call> calls;
+        vector<environment *> envs; // other root environments
+        vector<vector<node> *> roots; // vectors of nodes outside the heap
+        atomic<int> shared; // number of parallel regions running on the pool
+        int paused; // collection is put off while nonzero
+
+        heap();
+        ~heap();
+        void *alloc(size_t size);
+        void account(size_t bytes) { // memory held outside an object, counted at its creation
+            unique_lock<mutex> l(lock, defer_lock);
+            if (shared) l.lock();
+            stats.live_bytes += bytes;
+            stats.allocated_bytes += bytes;
+        }
+        void collect();
+        void mark(object *o) {
+            if (o == NULL || o->mark == epoch) return;
+            o->mark = epoch;
+            gray.push_back(o);
+        }
+        void mark(const node &n) {
+            if (n.is_object()) mark(n.v_obj);
+        }
+        bool owns(const object *o) const; // if o is an object of this heap
+        heap *outer() const; // the heap that was current when this was made, or if destroyed the one before it. NULL if none
+        static heap *&current(); // the heap that new objects of this thread go to
+        static bool &worker(); // if this thread is a pool worker
+    private:
+        struct page;
+        uint64_t serial; // distinct for every heap the process makes
+        uint64_t outer_serial; // of outer(), 0 if none. guarded by the lock of all heaps
+        unsigned int epoch;
+        size_t survived; // live_bytes after the last collection
+        vector<object *> gray; // marked, children not yet marked
+        vector<page *> pages;
+        unordered_map<uintptr_t, page *> page_of; // page address => page
+        map<uintptr_t, size_t> large; // address => size of objects too big for a page
+        vector<void *> free_slots; // head of the free list of each size class
+        mutex lock; // of allocation while shared
+        uintptr_t low, high; // bounds of all object memory
+        void *take(size_t size);
+        void new_page(size_t size_class);
+        void mark_word(uintptr_t w);
+        void scan_stack();
+        void scan_from_here();
+        void sweep();
+        heap(const heap &);
+        heap &operator=(const heap &);
+    };
+
+    class gc_root { // keeps the nodes of a vector outside the heap alive while in scope
+    private:
+        heap &h;
+    public:
+        gc_root(heap &h, vector<node> &v): h(h) {if (!heap::worker()) h.roots.push_back(&v);}
+        gc_root(vector<node> &v): h(*heap::current()) {if (!heap::worker()) h.roots.push_back(&v);}
+        ~gc_root() {if (!heap::worker()) h.roots.pop_back();}
     };
 
+    class gc_pause { // puts off collection of h while in scope, while building data that is all reachable
+    private:
+        heap &h;
+    public:
+        gc_pause(heap &h): h(h) {h.paused++;}
+        ~gc_pause() {h.paused--;}
+    };
+
+    class heap_scope { // makes h the current heap of this thread while in scope
+    private:
+        heap *saved;
+    public:
+        heap_scope(heap &h): saved(heap::current()) {heap::current() = &h;}
+        ~heap_scope() {heap::current() = saved;}
+    };
+
+    inline bool node::is_object() const {
+        return type == T_STRING || type == T_LIST || type == T_FN || type == T_SEQ || type == T_VEC || type == T_MAP;
+    }
+
+    inline const string &node::v_string() const {
+        static const string empty;
+        switch (type) {
+        case T_STRING: {
+            string_object *s = (string_object *) v_obj;
+            return s->buf == NULL ? s->v : s->flatten();}
+        case T_SYMBOL:
+            return symbol_table::global().names[v_int];
+        case T_LOCAL:
+            return symbol_table::global().names[v_addr.id];
+        default:
+            return empty;
+        }
+    }
+
+    inline list_object &node::v_list() const {
+        if (type == T_LIST) return *(list_object *) v_obj;
+        if (type == T_FN) return ((fn_object *) v_obj)->code.v_list();
+        if (type == T_SEQ) return ((seq_object *) v_obj)->list();
+        if (type == T_VEC) return ((vec_object *) v_obj)->list();
+        return list_object::empty_list();
+    }
+
+    struct chunk { // compiled bytecode of one expression
+        vector<int> code; // opcodes and their operands
+        vector<node> consts; // constants, symbols and fallback expressions
+        int max_stack;
+        chunk(): max_stack(0) {}
+    };
+
+    // an interpreter. all its state is in the instance, so distinct instances can run concurrently on
+    // separate threads. one instance runs on one thread at a time, apart from its own thread pool
     struct paren {
-        paren();
+        paren(); // becomes the current interpreter of this thread
+        ~paren(); // the interpreter that was current before it, or the nearest alive before that, becomes current again
 
         inline double rand_double();
-        vector<string> tokenize(const string &s);
-        vector<node> parse(const string &s);
+        vector<string> tokenize(string_view s);
+        vector<node> parse(string_view s);
+        static uint64_t hash(string_view s);
+        string serialize(const vector<node> &code, string_view source); // compact binary form of the code parsed from source
+        bool deserialize(string_view data, string_view source, vector<node> &code); // false unless data is the form of source. copies the nodes out of data
+        string snapshot(); // image of the global variables and all they refer to
+        bool restore(string_view data); // set the variables of a snapshot. false if it was not made by this version
 
+        heap gc; // strings, lists, closures and captured frames of this interpreter
+        symbol_table &symbols; // the global table. every T_SYMBOL holds its ID in v_int
         unordered_map<string, int> builtin_map;
+        vector<int> builtin_ids; // builtin of each symbol ID, or -1
         environment global_env; // variables
+        frame_arena frames; // activation frames that no closure can capture
+        bool vm; // if true, eval_all compiles each expression to bytecode and runs it on the VM
+        bool opt; // if true, eval_all optimizes the code first
+        int threads; // that run pmap, pfilter and preduce, counting the calling thread
+        unique_ptr<thread_pool> pool; // started on first use
+        bool jit; // if true, hot loops of numbers are compiled to machine code (x86-64 Linux only)
+        unique_ptr<native_code> native; // the compiled loops. made on first use
+        mutex lock; // held during a parallel region to resolve fn forms, print or draw random numbers
+        mt19937 rng; // of rand
+        ostream *out; // where pr, prn and the REPL write. cout by default
+        string out_buffer; // what pr and prn printed, not yet written to out
+        // when out_buffer is written to out: after each pr or prn, after each that ends a line, or when it
+        // holds OUT_BUFFER bytes. also when eval_all returns, and before exit and system
+        enum {FLUSH_EACH, FLUSH_LINE, FLUSH_FULL} flush_policy; // FLUSH_LINE by default
+        ostream *err; // error messages. cerr by default
+        istream *in; // read by the REPL. cin by default
+        struct statistics { // of self-specializing code
+            size_t specialized; // calls rewritten into a quickened form for the operand types they met
+            size_t deoptimized; // quickened calls that met other types and were rewritten back
+            size_t cached_calls; // of global fns found through the inline cache of the call
+            size_t uncached_calls; // looked up by name
+            size_t loops_compiled; // to machine code
+            size_t loops_deoptimized; // entered with variables of other types than they were compiled for
+        };
+        statistics stats;
+        struct call_site { // inline cache of the global fn that a call (NAME ARGUMENT ..) names
+            list_object *site; // the call
+            scope *sc; // of the environment it was looked up from
+            node *slot; // the global variable
+            size_t collections; // valid until the next collection, that may reuse the address of the call
+            unsigned int version; // and while no local environment gains a variable
+        };
+        vector<call_site> call_cache; // direct-mapped by the address of the call
+        unique_ptr<profiler> prof; // of the last profile_start
+        profiler *profiling; // prof while profiling, else NULL
+
+        // count the calls of each builtin and fn with their time, inclusive and exclusive, and sample the
+        // stack of calls every sample_us microseconds. fns are named by a variable that holds them. start
+        // and stop between evaluations; a start discards the results of the last
+        void profile_start(int sample_us = 1000);
+        void profile_stop();
+        void profile_report(ostream &o); // calls and ms of each, by exclusive time
+        void profile_stacks(ostream &o); // samples as collapsed stacks, "A;B;C N" per line, for flame graphs
 
         node eval(node &n, environment &env);
+        inline const node &eval_ref(node &n, environment &env, node &tmp); // eval without copying a variable's value
+        node call(const node &func, const node *args, int argc, environment &env); // apply a fn or builtin to values
+        node callee(node &n, environment &env); // value of the head of call n, through its inline cache
         node eval_all(vector<node> &lst);
+        void optimize(vector<node> &code); // fold constants, prune constant branches, simplify (^ X 2)
+        chunk compile(node &n);
+        node run(chunk &c, environment &env);
+        void flush(); // write out_buffer to out
         void print_symbols();
         void print_functions();
         void print_logo();
@@ -81,11 +530,25 @@ namespace libparen {
         inline void init();
         node eval_string(string &s);
         node eval_string(const char* s);
-        inline void eval_print(string &s);
+        inline void eval_print(vector<node> code); // evaluate and print the value of the last
         void repl(); // read-eval-print loop
 
-        node &get(const char* name);
-        void set(const char* name, node value);
+        node get(const char* name); // nil if unbound
+        node get(int id);
+        void set(const char* name, node value); // strings, lists, vectors and maps of another heap are copied to this one
+        void set(int id, node value);
     }; // struct paren
+
+    class paren_scope { // makes p the current interpreter of this thread while in scope
+    private:
+        heap *saved_heap;
+    public:
+        paren_scope(paren &p): saved_heap(heap::current()) {
+            heap::current() = &p.gc;
+        }
+        ~paren_scope() {
+            heap::current() = saved_heap;
+        }
+    };
 } // namespace libparen
 #endif
@@ -3,52 +3,275 @@
 
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <fstream>
 #include "libparen.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <process.h>
+#endif
 
 using namespace libparen;
 
-int main(int argc, char *argv[]) {    
-    if (argc <= 1) {
-        paren p;
-        p.print_logo();
-        p.repl();
-        puts("");
-        return 0;
+// the contents of a file, mapped into memory where the system allows
+class mapped_file {
+private:
+    char *data;
+    size_t size;
+    bool mapped;
+public:
+    bool ok;
+    mapped_file(const string &path): data(NULL), size(0), mapped(false), ok(false) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size = st.st_size;
+            ok = true;
+            if (size > 0) {
+                void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = (char *) p;
+                    mapped = true;
+                }
+            }
+        }
+        close(fd);
+        if (mapped || !ok) return;
+        ok = false;
+#endif
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == NULL) return;
+        fseek(file, 0, SEEK_END);
+        long n = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (n > 0) {
+            data = (char *) malloc(n);
+            size = fread(data, 1, n, file);
+        }
+        fclose(file);
+        ok = true;
+    }
+    ~mapped_file() {
+#ifndef _WIN32
+        if (mapped) {munmap(data, size); return;}
+#endif
+        free(data);
     }
-    else if (argc == 2) {
-        char *opt(argv[1]);
+    string_view view() const {return string_view(data, size);}
+};
+
+// where compiled scripts are kept: $PAREN_CACHE, else the user's cache directory
+static string cache_dir() {
+    const char *dir = getenv("PAREN_CACHE");
+    if (dir != NULL && dir[0] != 0) return dir;
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL && dir[0] != 0) return string(dir) + "/paren";
+    dir = getenv("HOME");
+    if (dir != NULL && dir[0] != 0) return string(dir) + "/.cache/paren";
+    return "";
+}
+
+static string cache_path(const string &dir, string_view source) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.pc", (unsigned long long) paren::hash(source));
+    return dir + name;
+}
+
+static void make_dirs(const string &dir) {
+#ifndef _WIN32
+    for (size_t i = 1; i <= dir.size(); i++) {
+        if (i == dir.size() || dir[i] == '/') mkdir(dir.substr(0, i).c_str(), 0755);
+    }
+#endif
+}
+
+static void write_cache(const string &dir, const string &path, const string &data) {
+    make_dirs(dir);
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), ".%ld.tmp", (long) getpid());
+    string tmp_path = path + tmp; // written aside and renamed, so that readers never see a partial file
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == NULL) return;
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) remove(tmp_path.c_str());
+}
+
+// the parsed code of source, from the cache when it holds it. rebuilt from the mapped entry, not used in place
+static vector<node> load(paren &p, string_view source, bool use_cache) {
+    vector<node> code;
+    string dir = use_cache ? cache_dir() : "";
+    if (dir.empty()) return p.parse(source);
+    string path = cache_path(dir, source);
+    {
+        mapped_file cached(path);
+        if (cached.ok && p.deserialize(cached.view(), source, code)) return code;
+    }
+    code = p.parse(source);
+    write_cache(dir, path, p.serialize(code, source));
+    return code;
+}
+
+static bool write_file(const string &path, const string &data) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && ok;
+}
+
+int main(int argc, char *argv[]) {
+    bool vm = false;
+    bool optimize = false;
+    bool jit = true;
+    bool use_cache = true;
+    bool compile_only = false;
+    bool print_stats = false;
+    int threads = 0; // 0: one per core
+    const char *load_path = NULL, *save_path = NULL; // snapshots
+    const char *profile_path = NULL; // collapsed stacks
+    int first_file = 1;
+    for (; first_file < argc && argv[first_file][0] == '-'; first_file++) {
+        char *opt(argv[first_file]);
         if (strcmp(opt, "-h") == 0) {
             puts("Usage: paren [OPTIONS...] [FILES...]");
             puts("");
             puts("OPTIONS:");
             puts("    -h    print this screen.");
             puts("    -v    print version.");
+            puts("    -b    run on the bytecode virtual machine.");
+            puts("    -O    optimize the code before running it.");
+            puts("    -J    do not compile hot loops to machine code.");
+            puts("    -j N  run pmap, pfilter and preduce on N threads. (default: one per core)");
+            puts("    -c    compile FILES into the cache without running them.");
+            puts("    -n    do not use the compiled-script cache.");
+            puts("    -l F  start from the snapshot in file F.");
+            puts("    -s F  run FILES (or the REPL) in one interpreter, then save its snapshot to file F.");
+            puts("    -q    print the statistics of quickening and call caching to stderr after running.");
+            puts("    -p F  profile: print the calls and time of each function to stderr, and write sampled stacks to file F.");
             return 0;
         } else if (strcmp(opt, "-v") == 0) {
             puts(PAREN_VERSION);
             return 0;
+        } else if (strcmp(opt, "-b") == 0) {
+            vm = true;
+        } else if (strcmp(opt, "-O") == 0) {
+            optimize = true;
+        } else if (strcmp(opt, "-J") == 0) {
+            jit = false;
+        } else if (strcmp(opt, "-j") == 0 && first_file + 1 < argc) {
+            threads = atoi(argv[++first_file]);
+        } else if (strcmp(opt, "-c") == 0) {
+            compile_only = true;
+        } else if (strcmp(opt, "-n") == 0) {
+            use_cache = false;
+        } else if (strcmp(opt, "-l") == 0 && first_file + 1 < argc) {
+            load_path = argv[++first_file];
+        } else if (strcmp(opt, "-s") == 0 && first_file + 1 < argc) {
+            save_path = argv[++first_file];
+        } else if (strcmp(opt, "-q") == 0) {
+            print_stats = true;
+        } else if (strcmp(opt, "-p") == 0 && first_file + 1 < argc) {
+            profile_path = argv[++first_file];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            return 1;
+        }
+    }
+
+    ofstream stacks;
+    if (profile_path != NULL) {
+        stacks.open(profile_path);
+        if (!stacks) {
+            fprintf(stderr, "Cannot write file: %s\n", profile_path);
+            return 1;
         }
     }
+    mapped_file *snapshot = NULL;
+    if (load_path != NULL) {
+        snapshot = new mapped_file(load_path);
+        if (!snapshot->ok) {
+            fprintf(stderr, "Cannot open file: %s\n", load_path);
+            return 1;
+        }
+    }
+    auto start = [&](paren &p) {
+        p.vm = vm;
+        p.opt = optimize;
+        p.jit = jit;
+#ifndef _WIN32
+        if (!isatty(STDOUT_FILENO)) p.flush_policy = paren::FLUSH_FULL; // to a file or pipe
+#endif
+        if (threads > 0) p.threads = threads;
+        if (snapshot != NULL && !p.restore(snapshot->view())) {
+            fprintf(stderr, "Invalid snapshot: %s\n", load_path);
+            exit(1);
+        }
+        if (profile_path != NULL) p.profile_start();
+    };
+    auto finish = [&](paren &p) {
+        if (profile_path != NULL) { // of each file, or of the REPL
+            p.profile_stop();
+            p.profile_report(cerr);
+            p.profile_stacks(stacks);
+            p.profile_start();
+        }
+        if (print_stats) {
+            fprintf(stderr, "specialized: %zu, deoptimized: %zu, cached calls: %zu, uncached calls: %zu, "
+                "loops compiled: %zu, loops deoptimized: %zu\n", p.stats.specialized, p.stats.deoptimized,
+                p.stats.cached_calls, p.stats.uncached_calls, p.stats.loops_compiled, p.stats.loops_deoptimized);
+        }
+    };
+    auto save = [&](paren &p) {
+        if (save_path != NULL && !write_file(save_path, p.snapshot())) {
+            fprintf(stderr, "Cannot write file: %s\n", save_path);
+            exit(1);
+        }
+    };
 
-    // execute files, one by one
-    for (int i = 1; i < argc; i++) {
+    if (first_file >= argc) {
+        if (compile_only) return 0;
         paren p;
-        FILE *file = fopen(argv[i], "r");
-        if (file != NULL) {
-            fseek(file, 0, SEEK_END);
-            long size = ftell(file);
-            fseek(file, 0, SEEK_SET);
-            char *code = (char *) malloc((size + 1) * sizeof(char)); // size + null
-            code[size] = 0;
-            fread(code, sizeof(char), size, file);
-            fclose(file);
-            
-            string strCode(code);            
-            p.eval_string(strCode);
-            free(code); code = NULL;
+        start(p);
+        p.print_logo();
+        p.repl();
+        puts("");
+        finish(p);
+        save(p);
+        return 0;
+    }
+
+    if (compile_only && cache_dir().empty()) {
+        fprintf(stderr, "No cache directory: set PAREN_CACHE\n");
+        return 1;
+    }
+
+    // execute files, one by one. in one interpreter if its snapshot is saved
+    unique_ptr<paren> interpreter;
+    for (int i = first_file; i < argc; i++) {
+        if (save_path == NULL || !interpreter) {
+            interpreter.reset();
+            interpreter.reset(new paren);
+            start(*interpreter);
+        }
+        paren &p = *interpreter;
+        mapped_file file(argv[i]);
+        if (file.ok) {
+            vector<node> code = load(p, file.view(), use_cache || compile_only);
+            if (compile_only) continue;
+            gc_root root(p.gc, code);
+            p.eval_all(code);
+            finish(p);
         }
         else {
             fprintf(stderr, "Cannot open file: %s\n", argv[i]);
         }
     }
+    save(*interpreter);
+    delete snapshot;
 }
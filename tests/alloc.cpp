@@ -0,0 +1,43 @@
+// nth, length and strlen of a variable read it in place: they allocate nothing
+#include "libparen.h"
+#include <iostream>
+
+using namespace std;
+using namespace libparen;
+
+static int failures = 0;
+
+// objects that running code allocates, once parsed
+static size_t allocated(paren &p, const char *code) {
+    vector<node> parsed = p.parse(code);
+    gc_root r(p.gc, parsed);
+    size_t before = p.gc.stats.allocated_objects;
+    p.eval_all(parsed);
+    return p.gc.stats.allocated_objects - before;
+}
+
+static void check(paren &p, const char *code) {
+    size_t n = allocated(p, code);
+    if (n == 0) return;
+    cerr << "FAIL " << (p.vm ? "vm: " : "") << code << " allocated " << n << " objects" << endl;
+    failures++;
+}
+
+int main() {
+    for (int vm = 0; vm < 2; vm++) {
+        paren p;
+        p.vm = vm != 0;
+        p.eval_string("(set l (list 1 2 3 4 5)) (set big (range 1 1000 1)) (set s (strcat \"abc\" \"def\")) (set i 2)");
+        p.eval_string("(length big)"); // realized once
+        check(p, "(nth 1 l)");
+        check(p, "(nth i l)");
+        check(p, "(nth 500 big)");
+        check(p, "(length l)");
+        check(p, "(length big)");
+        check(p, "(strlen s)");
+        check(p, "(for j 0 999 1 (nth (% j 5) l) (length l) (strlen s))");
+    }
+    if (failures > 0) return 1;
+    cout << "alloc: ok" << endl;
+    return 0;
+}
@@ -0,0 +1,123 @@
+// interpreters on separate threads, and several on one thread. built with -fsanitize=thread by make test
+#include "libparen.h"
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+using namespace libparen;
+
+static atomic<int> failures(0);
+
+static void check(bool ok, const string &what) {
+    if (ok) return;
+    cerr << "FAIL " << what << endl;
+    failures++;
+}
+
+// output of code run by p
+static string run(paren &p, const string &code) {
+    ostringstream out;
+    p.out = &out;
+    p.eval_string(code.c_str());
+    p.out = &cout;
+    return out.str();
+}
+
+// each thread has its own interpreter, with its own pool, and names symbols of its own
+static void worker(int n) {
+    paren p;
+    p.threads = 2;
+    string name = "only-" + to_string(n);
+    string got = run(p,
+        "(set fib (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))"
+        "(set m (hash-map))"
+        "(for i 0 99 1 (put m i (strcat \"v\" i)))"
+        "(set " + name + " (quote " + name + "))"
+        "(prn (fib 20) (get m 42) (length (keys m)) " + name + ")"
+        "(prn (preduce + 0 (pmap (fn (x) (* x x)) (range 1 1000 1))))"
+        "(prn (sum (i64vec (range 1 100 1))))");
+    check(got == "6765 v42 100 " + name + "\n333833500\n5050\n", "worker " + to_string(n) + ": " + got);
+    check(p.get(name.c_str()).v_string() == name, "symbol name on worker " + to_string(n));
+}
+
+int main() {
+    // the name of a symbol of one interpreter, read while another is current
+    {
+        paren p1;
+        paren p2;
+        p1.eval_string("(set greeting (quote hello))");
+        check(p1.get("greeting").v_string() == "hello", "symbol of an interpreter that is not current");
+    }
+
+    // an interpreter that outlives one made after it is current again once that one is destroyed
+    {
+        paren p1;
+        {
+            paren p2;
+        }
+        p1.set("a", node(string("x")));
+        check(run(p1, "(prn a)") == "x\n", "set after a nested interpreter is destroyed");
+    }
+
+    // a value made while another interpreter is current is copied by set
+    {
+        paren p1;
+        {
+            paren p2;
+            p1.set("a", node(string("made in p2")));
+            p2.eval_string("(set m (hash-map 1 (list \"s\" 2.5) \"k\" (i64vec 1 2))) (put m 2 m)");
+            p1.set("m", p2.get("m"));
+        }
+        check(run(p1, "(prn a (get m 1) (get m \"k\") (get (get m 2) 1))") == "made in p2 (s 2.5) (1 2) (s 2.5)\n",
+            "set of values of another heap");
+    }
+
+    // interpreters destroyed out of order
+    {
+        paren p1;
+        paren *a = new paren;
+        paren *b = new paren;
+        delete a;
+        delete b;
+        p1.set("s", node(string("y")));
+        check(run(p1, "(prn (strcat s s))") == "yy\n", "set after interpreters destroyed out of order");
+    }
+
+    // workers of one pool realizing the same lazy seq at once
+    {
+        paren p;
+        p.threads = 8;
+        string got = run(p,
+            "(set n 0)"
+            "(for k 1 20 1"
+            "  (set s (map (fn (x) (* x 2)) (range 1 2000 1)))"
+            "  (set t (map (fn (x) (* x 3)) (range 1 2000 1)))"
+            "  (set n (+ n (apply + (pmap (fn (x) (length s)) (range 1 64 1))) (apply + (pmap (fn (x) (nth x t)) (range 1 64 1))))))"
+            "(prn n)");
+        check(got == "2688640\n", "seq realized by the workers of a pool: " + got);
+    }
+
+    // and reading the same vectors as lists
+    {
+        paren p;
+        p.threads = 8;
+        string got = run(p,
+            "(set n 0)"
+            "(for k 1 20 1"
+            "  (set v (f64vec 1.5 2.5 3.5))"
+            "  (set w (i64vec (range 1 100 1)))"
+            "  (set n (+ n (apply + (pmap (fn (x) (nth 1 (to-list v))) (range 1 64 1))) (apply + (pmap (fn (x) (nth x w)) (range 1 64 1))))))"
+            "(prn n)");
+        check(got == "46080\n", "vector listed by the workers of a pool: " + got);
+    }
+
+    const int N = 8;
+    vector<thread> threads;
+    for (int i = 0; i < N; i++) threads.push_back(thread(worker, i));
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+
+    if (failures > 0) return 1;
+    cout << "concurrency: ok" << endl;
+    return 0;
+}